@@ -0,0 +1,20 @@
+/* EEPROM emulated in RAM, initially erased (all bytes 0xff). */
+
+#ifndef _AVR_EEPROM_H_
+#define _AVR_EEPROM_H_
+
+#include <stdint.h>
+
+#define E2END 511
+
+extern uint8_t eeprom[E2END+1];
+/* number of bytes actually written, to spot needless EEPROM wear */
+extern unsigned long eeprom_writes;
+
+uint8_t eeprom_read_byte(const uint8_t *addr);
+uint16_t eeprom_read_word(const uint16_t *addr);
+void eeprom_write_byte(uint8_t *addr, uint8_t value);
+void eeprom_write_word(uint16_t *addr, uint16_t value);
+void eeprom_update_byte(uint8_t *addr, uint8_t value);
+
+#endif /* _AVR_EEPROM_H_ */
@@ -0,0 +1,9 @@
+/* There are no interrupts on the host. */
+
+#ifndef _AVR_INTERRUPT_H_
+#define _AVR_INTERRUPT_H_
+
+#define cli()
+#define sei()
+
+#endif /* _AVR_INTERRUPT_H_ */
@@ -0,0 +1,14 @@
+/* Registers used by the device logic, backed by plain variables. */
+
+#ifndef _AVR_IO_H_
+#define _AVR_IO_H_
+
+#include <stdint.h>
+
+extern volatile uint8_t PORTB, OSCCAL;
+
+#define PB1 1
+#define PB3 3
+#define PB4 4
+
+#endif /* _AVR_IO_H_ */
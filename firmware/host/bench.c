@@ -0,0 +1,122 @@
+/* Runs the device logic at host speed: checks request handling and the
+ * PWM duty cycle math, and measures how fast both run.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include "usbdrv.h"
+#include "requests.h"
+#include "rgblogic.h"
+
+#define RQ_OUT (USBRQ_TYPE_VENDOR | USBRQ_DIR_HOST_TO_DEVICE)
+#define RQ_IN  (USBRQ_TYPE_VENDOR | USBRQ_DIR_DEVICE_TO_HOST)
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+	if (!ok) {
+		printf("FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* run n complete PWM cycles and count the ticks the red LED was lit */
+static unsigned long count_red(unsigned long n) {
+	unsigned long i, on = 0;
+	for (i = 0; i < n * 256; i++) {
+		update_leds();
+		if (PORTB & 1<<PB4)
+			on++;
+	}
+	return on;
+}
+
+static void check_requests(void) {
+	uchar rgb[3] = {0x12, 0x34, 0x56};
+	uchar rgb16[6] = {0x80, 0x12, 0x00, 0x00, 0xff, 0xff};
+	uchar white[3] = {255, 127, 0};
+	struct device_stats st;
+	unsigned long writes;
+
+	check(usbMockControl(RQ_OUT, CUSTOM_RQ_SET_RGB, 0, 0, rgb, 3) == 3, "SET_RGB transfer");
+	check(color[0] == 0x1200 && color[1] == 0x3400 && color[2] == 0x5600, "SET_RGB color");
+
+	check(usbMockControl(RQ_OUT, CUSTOM_RQ_SET_RGB16, 0, 0, rgb16, 6) == 6, "SET_RGB16 transfer");
+	check(color[0] == 0x1280 && color[1] == 0 && color[2] == 0xffff, "SET_RGB16 color");
+
+	/* the fraction 0x80 must add one duty step in every other cycle */
+	count_red(1);
+	check(count_red(256) == 256 * 0x12 + 0x80, "dithered duty cycle");
+
+	writes = eeprom_writes;
+	usbMockControl(RQ_OUT, CUSTOM_RQ_SET_GAMMA, GAMMA_2_2, 0, NULL, 0);
+	check(eeprom_writes == writes, "no EEPROM write within the request");
+	save_correction();
+	check(eeprom_read_byte(EE_GAMMA) == GAMMA_2_2, "gamma stored in EEPROM");
+	check(color[0] < 0x1280 && color[2] >= 0xff00, "gamma curve applied");
+	writes = eeprom_writes;
+	usbMockControl(RQ_OUT, CUSTOM_RQ_SET_GAMMA, GAMMA_2_2, 0, NULL, 0);
+	save_correction();
+	check(eeprom_writes == writes, "unchanged gamma not rewritten");
+	usbMockControl(RQ_OUT, CUSTOM_RQ_SET_GAMMA, GAMMA_LINEAR, 0, NULL, 0);
+
+	usbMockControl(RQ_OUT, CUSTOM_RQ_SET_WHITE, 0, 0, white, 3);
+	check(color[0] == 0x1280 && color[1] == 0 && color[2] == 0, "white balance applied");
+	save_correction();
+	check(eeprom_read_byte(EE_WHITE+1) == 127, "white balance stored in EEPROM");
+	memset(white, 255, sizeof(white));
+	usbMockControl(RQ_OUT, CUSTOM_RQ_SET_WHITE, 0, 0, white, 3);
+
+	memset(&st, 0, sizeof(st));
+	OSCCAL = 0x5a;
+	check(usbMockControl(RQ_IN, CUSTOM_RQ_GET_STATS, 0, 0, (uchar *)&st, sizeof(st)) == sizeof(st), "GET_STATS transfer");
+	check(st.version == STATS_VERSION, "stats version");
+	check(st.osccal == 0x5a, "stats osccal");
+	check(st.updates == 2, "stats updates");
+	check(st.bytes == 3 + 6 + 3 + 3, "stats bytes");
+	check(st.pwm_cycles == 257, "stats PWM cycles");
+}
+
+static void bench_requests(unsigned long n) {
+	uchar rgb[3];
+	unsigned long i;
+	double t;
+
+	usbMockControl(RQ_OUT, CUSTOM_RQ_SET_GAMMA, GAMMA_2_2, 0, NULL, 0);
+	t = now();
+	for (i = 0; i < n; i++) {
+		rgb[0] = i;
+		rgb[1] = i>>8;
+		rgb[2] = i>>16;
+		usbMockControl(RQ_OUT, CUSTOM_RQ_SET_RGB, 0, 0, rgb, 3);
+	}
+	t = now() - t;
+	printf("SET_RGB with gamma: %.1f ns/request\n", t / n * 1e9);
+}
+
+static void bench_pwm(unsigned long cycles) {
+	double t = now();
+	unsigned long on = count_red(cycles);
+	t = now() - t;
+	printf("PWM: %.2f ns/tick (%lu of %lu ticks lit)\n", t / (cycles * 256) * 1e9, on, cycles * 256);
+}
+
+int main(void) {
+	check_requests();
+	bench_requests(1000000);
+	bench_pwm(100000);
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
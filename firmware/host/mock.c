@@ -0,0 +1,73 @@
+/* Host side stand-ins for the AVR registers, the EEPROM and the V-USB
+ * control transfer handling.
+ */
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include "usbdrv.h"
+
+volatile uint8_t PORTB, OSCCAL;
+
+uint8_t eeprom[E2END+1] = { [0 ... E2END] = 0xff };
+unsigned long eeprom_writes;
+
+uint8_t eeprom_read_byte(const uint8_t *addr) {
+	return eeprom[(uintptr_t)addr];
+}
+
+uint16_t eeprom_read_word(const uint16_t *addr) {
+	const uint8_t *p = (const uint8_t *)addr;
+	return eeprom_read_byte(p) | eeprom_read_byte(p+1)<<8;
+}
+
+void eeprom_write_byte(uint8_t *addr, uint8_t value) {
+	eeprom[(uintptr_t)addr] = value;
+	eeprom_writes++;
+}
+
+void eeprom_write_word(uint16_t *addr, uint16_t value) {
+	uint8_t *p = (uint8_t *)addr;
+	eeprom_write_byte(p, value);
+	eeprom_write_byte(p+1, value>>8);
+}
+
+void eeprom_update_byte(uint8_t *addr, uint8_t value) {
+	if (eeprom_read_byte(addr) != value)
+		eeprom_write_byte(addr, value);
+}
+
+int usbMockControl(uchar requestType, uchar request, uint16_t value,
+		uint16_t index, uchar *data, uint16_t len) {
+	uchar setup[8] = {
+		requestType, request,
+		value, value>>8,
+		index, index>>8,
+		len, len>>8
+	};
+	uint16_t pos = 0;
+	uchar chunk, n;
+
+	if (usbFunctionSetup(setup) != USB_NO_MSG)
+		return 0;   /* replies through usbMsgPtr are not used by the device */
+
+	while (pos < len) {
+		chunk = len - pos > 8 ? 8 : len - pos;
+		if ((requestType & USBRQ_DIR_MASK) == USBRQ_DIR_DEVICE_TO_HOST) {
+			n = usbFunctionRead(data + pos, chunk);
+			if (n == 0xff)
+				return -1;
+			pos += n;
+			if (n < chunk)
+				break;
+		} else {
+			n = usbFunctionWrite(data + pos, chunk);
+			if (n == 0xff)
+				return -1;
+			pos += chunk;
+			if (n == 1)
+				break;
+		}
+	}
+	return pos;
+}
@@ -0,0 +1,53 @@
+/* Mock of the V-USB driver interface for building the device logic on
+ * the host. Only the types and constants used by rgblogic.c are provided;
+ * usbMockControl() plays the part of the driver and runs a complete
+ * control transfer through the usbFunction*() callbacks.
+ */
+
+#ifndef __usbdrv_h_included__
+#define __usbdrv_h_included__
+
+#include <stdint.h>
+
+typedef unsigned char uchar;
+typedef uchar usbMsgLen_t;
+
+#define USB_NO_MSG ((usbMsgLen_t)-1)
+
+#define USBRQ_DIR_MASK          0x80
+#define USBRQ_DIR_HOST_TO_DEVICE (0<<7)
+#define USBRQ_DIR_DEVICE_TO_HOST (1<<7)
+
+#define USBRQ_TYPE_MASK         0x60
+#define USBRQ_TYPE_STANDARD     (0<<5)
+#define USBRQ_TYPE_CLASS        (1<<5)
+#define USBRQ_TYPE_VENDOR       (2<<5)
+
+typedef union usbWord {
+	uint16_t word;
+	uchar bytes[2];
+} usbWord_t;
+
+typedef struct usbRequest {
+	uchar bmRequestType;
+	uchar bRequest;
+	usbWord_t wValue;
+	usbWord_t wIndex;
+	usbWord_t wLength;
+} usbRequest_t;
+
+extern char usbHidReportDescriptor[];
+
+usbMsgLen_t usbFunctionSetup(uchar data[8]);
+uchar usbFunctionWrite(uchar *data, uchar len);
+uchar usbFunctionRead(uchar *data, uchar len);
+
+/* Run a vendor control transfer like the host would: OUT transfers hand
+ * len bytes of data to usbFunctionWrite(), IN transfers fill data with up
+ * to len bytes from usbFunctionRead(). Returns the number of bytes
+ * transferred, or -1 if the device stalled.
+ */
+int usbMockControl(uchar requestType, uchar request, uint16_t value,
+		uint16_t index, uchar *data, uint16_t len);
+
+#endif /* __usbdrv_h_included__ */
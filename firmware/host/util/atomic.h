@@ -0,0 +1,9 @@
+/* There are no interrupts on the host, the block just runs once. */
+
+#ifndef _UTIL_ATOMIC_H_
+#define _UTIL_ATOMIC_H_
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type) for (int atomic_once = 1; atomic_once; atomic_once = 0)
+
+#endif /* _UTIL_ATOMIC_H_ */
@@ -6,6 +6,47 @@
 #ifndef __REQUESTS_H_INCLUDED__
 #define __REQUESTS_H_INCLUDED__
 
+#include <stdint.h>
+
 #define CUSTOM_RQ_SET_RGB    3
+/* Set the LED color with 3 bytes of data (red, green, blue). */
+
+#define CUSTOM_RQ_SET_RGB16  4
+/* Set the LED color with 6 bytes of data: red, green and blue as
+ * little endian 16 bit values. The upper byte selects the PWM duty
+ * cycle, the lower byte is spread over consecutive PWM cycles by
+ * dithering. 12 bit values have to be shifted left by 4 bits.
+ */
+
+#define CUSTOM_RQ_SET_GAMMA  5
+/* Select the brightness curve applied to all following colors by the
+ * device: wValue 0 is linear, GAMMA_2_2 and GAMMA_2_8 select the curves
+ * stored in the firmware. The setting is kept in EEPROM.
+ */
+#define GAMMA_LINEAR 0
+#define GAMMA_2_2    1
+#define GAMMA_2_8    2
+
+#define CUSTOM_RQ_SET_WHITE  6
+/* Set the white balance with 3 bytes of data: the scale applied to the
+ * red, green and blue channel after the brightness curve, 255 being full
+ * brightness. The setting is kept in EEPROM.
+ */
+
+#define CUSTOM_RQ_GET_STATS  7
+/* Read the device statistics as struct device_stats. */
+
+#define STATS_VERSION 1
+/* All multi byte values are little endian. */
+struct device_stats {
+	uint8_t version;        /* STATS_VERSION */
+	uint8_t osccal;         /* current oscillator calibration */
+	uint16_t wdt_resets;    /* watchdog resets since EEPROM was erased */
+	uint32_t updates;       /* colors received */
+	uint32_t bytes;         /* payload bytes received */
+	uint32_t pwm_cycles;    /* completed PWM cycles */
+	uint16_t max_latency;   /* longest main loop iteration, in units of 1024
+	                         * CPU cycles, saturating at 0xffff */
+} __attribute__((packed));
 
 #endif /* __REQUESTS_H_INCLUDED__ */
@@ -4,112 +4,142 @@
 #include <avr/wdt.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
+#include <util/atomic.h>
 
 #include "usbdrv.h"
 #include "requests.h" /* custom requests used */
+#include "rgblogic.h"
 
-PROGMEM char usbHidReportDescriptor[22] = {    /* USB report descriptor */
-	0x06, 0x00, 0xff,              // USAGE_PAGE (Generic Desktop)
-	0x09, 0x01,                    // USAGE (Vendor Usage 1)
-	0xa1, 0x01,                    // COLLECTION (Application)
-	0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
-	0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
-	0x75, 0x08,                    //   REPORT_SIZE (8)
-	0x95, 0x01,                    //   REPORT_COUNT (1)
-	0x09, 0x00,                    //   USAGE (Undefined)
-	0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
-	0xc0                           // END_COLLECTION
-};
-
-static uint8_t color[3] = {255,0,0};
-
-usbMsgLen_t usbFunctionSetup(uchar data[8]) {
-	usbRequest_t    *rq = (usbRequest_t *)data;
-
-	if((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_VENDOR) {
-		switch(rq->bRequest) {
-			case CUSTOM_RQ_SET_RGB:
-				return USB_NO_MSG;
-		}
-	} else {
-		/* calls requests USBRQ_HID_GET_REPORT and USBRQ_HID_SET_REPORT are
-		* not implemented since we never call them. The operating system
-		* won't call them either because our descriptor defines no meaning.
-		*/
-	}
-	return 0;   /* default for not implemented requests: return no data back to host */
-}
+/* when a calibration value is known, only search this far around it */
+#define OSCCAL_RANGE 2
 
-uchar usbFunctionWrite(uchar *data, uchar len) {
-	color[0] = data[0];
-	color[1] = data[1];
-	color[2] = data[2];
-	return 1;
-}
+/* set if OSCCAL already holds a calibrated value (restored or measured) */
+static uchar osccalValid;
 
 static void calibrateOscillator(void) {
 	uchar       step = 128;
 	uchar       trialValue = 0, optimumValue;
+	uchar       range = 1, lo, hi, i;
 	int         x, optimumDev, targetValue = (unsigned)(1499 * (double)F_CPU / 10.5e6 + 0.5);
 
-	/* do a binary search: */
-	do {
-		OSCCAL = trialValue + step;
-		x = usbMeasureFrameLength();    // proportional to current real frequency
-		if(x < targetValue)             // frequency still too low
-			trialValue += step;
-		step >>= 1;
-	} while (step > 0);
-	/* We have a precision of +/- 1 for optimum OSCCAL here */
+	if (osccalValid) {
+		/* the clock is close to the last calibration, skip the binary search */
+		trialValue = OSCCAL;
+		range = OSCCAL_RANGE;
+		x = 0x7fff;
+	} else {
+		/* do a binary search: */
+		do {
+			OSCCAL = trialValue + step;
+			x = usbMeasureFrameLength();    // proportional to current real frequency
+			if(x < targetValue)             // frequency still too low
+				trialValue += step;
+			step >>= 1;
+		} while (step > 0);
+		/* We have a precision of +/- 1 for optimum OSCCAL here */
+	}
 	/* now do a neighborhood search for optimum value */
+	lo = trialValue > range ? trialValue - range : 0;
+	hi = trialValue < 255 - range ? trialValue + range : 255;
 	optimumValue = trialValue;
 	optimumDev = x; // this is certainly far away from optimum
-	for (OSCCAL = trialValue - 1; OSCCAL <= trialValue + 1; OSCCAL++) {
+	for (i = lo; ; i++) {
+		OSCCAL = i;
 		x = usbMeasureFrameLength() - targetValue;
 		if(x < 0)
 			x = -x;
 		if(x < optimumDev){
 			optimumDev = x;
-			optimumValue = OSCCAL;
+			optimumValue = i;
 		}
+		if (i == hi)
+			break;
+	}
+	if (osccalValid && (optimumValue == lo || optimumValue == hi)) {
+		/* the optimum may lie outside of the searched range */
+		osccalValid = 0;
+		calibrateOscillator();
+		return;
 	}
 	OSCCAL = optimumValue;
+	osccalValid = 1;
 }
 
 void usbEventResetReady(void) {
 	cli();  // usbMeasureFrameLength() counts CPU cycles, so disable interrupts.
 	calibrateOscillator();
 	sei();
-	eeprom_write_byte(0, OSCCAL);   // store the calibrated value in EEPROM
+	eeprom_update_byte(EE_OSCCAL, OSCCAL);   // store the calibrated value in EEPROM if it changed
 }
 
-static void inline set_led(uint8_t cnt, uint8_t setting, volatile uint8_t *port, uint8_t bit) {
-	if (cnt < setting) {
-		*port |= 1<<bit;
-	} else {
-		*port &= ~(1<<bit);
+/* start with the value found during the last calibration */
+static void restoreOscillator(void) {
+	uchar stored = eeprom_read_byte(EE_OSCCAL);
+	if (stored != 0xff) {
+		OSCCAL = stored;
+		osccalValid = 1;
 	}
 }
 
-static void update_leds(void) {
-	static volatile uint8_t cnt = 0;
-	set_led(cnt, color[0], &PORTB, PB4);
-	set_led(cnt, color[1], &PORTB, PB3);
-	set_led(cnt, color[2], &PORTB, PB1);
-	cnt++;
-	cnt %= 256;
+/* count resets caused by the watchdog in EEPROM */
+static void count_wdt_reset(void) {
+	uint16_t n = eeprom_read_word(EE_WDT_RESETS);
+	uchar wdt = MCUSR & (1<<WDRF);
+	if (n == 0xffff)
+		n = 0;
+	/* after a watchdog reset it keeps running with the shortest timeout,
+	 * less than writing EEPROM takes; WDRF has to be cleared first
+	 */
+	MCUSR = 0;
+	wdt_disable();
+	if (wdt)
+		eeprom_write_word(EE_WDT_RESETS, ++n);
+	stats.wdt_resets = n;
+}
+
+/* timer 1 runs at CK/1024 and overflows every 15.9 ms, the overflows
+ * extend it to 24 bits so that long stalls of the main loop are measured
+ * too
+ */
+static volatile uint16_t timer1_overflows;
+
+ISR(TIMER1_OVF_vect, ISR_NOBLOCK) {
+	timer1_overflows++;
+}
+
+/* time in units of 1024 CPU cycles */
+static uint32_t loop_clock(void) {
+	uint8_t lo;
+	uint16_t hi;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		lo = TCNT1;
+		hi = timer1_overflows;
+		/* the counter wrapped, but the interrupt has not run yet */
+		if ((TIFR & 1<<TOV1) && lo < 128)
+			hi++;
+	}
+	return (uint32_t)hi << 8 | lo;
 }
 
 int main(void) {
+	uint32_t loop_start, loop_time, now;
+
+	restoreOscillator();
+	count_wdt_reset();
 #if USE_TIMER
 	/* configure timer */
         TCCR0B = 1<<CS00;
 	OCR0A = 0x10;
-	TIMSK0 |= (1 << OCIE0A);
+	TIMSK |= 1<<OCIE0A; /* the tinyX5 has a single TIMSK */
 #endif
+	/* timer 1 measures the main loop latency */
+	TCCR1 = 1<<CS13 | 1<<CS11 | 1<<CS10; /* CK/1024 */
+	TIMSK |= 1<<TOIE1;
 	/* configure outputs */
 	DDRB = (1<<PB1 | 1<<PB3 | 1<<PB4);
 
+	load_correction();
+
 	wdt_enable(WDTO_1S);
 
 	/* prepare USB */
@@ -125,12 +155,22 @@ int main(void) {
 
 	sei();
 
+	loop_start = loop_clock();
 	while (1) {
 #if !USE_TIMER
 		update_leds();
 #endif
 		wdt_reset();
 		usbPoll();
+		save_correction();
+		now = loop_clock();
+		loop_time = (now - loop_start) & 0xffffff;
+		loop_start = now;
+		/* saturate rather than wrap */
+		if (loop_time > 0xffff)
+			loop_time = 0xffff;
+		if (loop_time > stats.max_latency)
+			stats.max_latency = loop_time;
 	}
 }
 
@@ -0,0 +1,202 @@
+/* Device logic of the firmware: request handling, color correction and
+ * the PWM engine. It does not touch any hardware except the LED port and
+ * EEPROM, so it can also be built on the host against the mocks in host/.
+ */
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "usbdrv.h"
+#include "requests.h" /* custom requests used */
+#include "rgblogic.h"
+
+PROGMEM char usbHidReportDescriptor[22] = {    /* USB report descriptor */
+	0x06, 0x00, 0xff,              // USAGE_PAGE (Generic Desktop)
+	0x09, 0x01,                    // USAGE (Vendor Usage 1)
+	0xa1, 0x01,                    // COLLECTION (Application)
+	0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+	0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
+	0x75, 0x08,                    //   REPORT_SIZE (8)
+	0x95, 0x01,                    //   REPORT_COUNT (1)
+	0x09, 0x00,                    //   USAGE (Undefined)
+	0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+	0xc0                           // END_COLLECTION
+};
+
+/* brightness curves, sampled at 65 points of the 8.8 input range and
+ * interpolated linearly in between; indexed by GAMMA_* - 1
+ */
+#define GAMMA_CURVES 2
+PROGMEM const uint16_t gammaCurve[GAMMA_CURVES][65] = {
+	/* gamma 2.2 */
+	{
+		0x0000, 0x0007, 0x0020, 0x004e, 0x0093, 0x00f0, 0x0167, 0x01f8,
+		0x02a4, 0x036b, 0x0450, 0x0551, 0x0670, 0x07ae, 0x090a, 0x0a85,
+		0x0c20, 0x0ddb, 0x0fb6, 0x11b2, 0x13d0, 0x160e, 0x186f, 0x1af1,
+		0x1d96, 0x205e, 0x2349, 0x2657, 0x2988, 0x2cde, 0x3057, 0x33f5,
+		0x37b7, 0x3b9e, 0x3faa, 0x43db, 0x4832, 0x4cae, 0x5150, 0x5618,
+		0x5b07, 0x601c, 0x6557, 0x6aba, 0x7043, 0x75f4, 0x7bcc, 0x81cb,
+		0x87f2, 0x8e41, 0x94b8, 0x9b58, 0xa21f, 0xa910, 0xb029, 0xb76a,
+		0xbed5, 0xc669, 0xce26, 0xd60c, 0xde1c, 0xe656, 0xeeba, 0xf747,
+		0xffff,
+	},
+	/* gamma 2.8 */
+	{
+		0x0000, 0x0001, 0x0004, 0x000c, 0x001c, 0x0034, 0x0057, 0x0085,
+		0x00c2, 0x010e, 0x016a, 0x01d9, 0x025c, 0x02f3, 0x03a2, 0x0468,
+		0x0547, 0x0641, 0x0757, 0x088a, 0x09dc, 0x0b4d, 0x0ce0, 0x0e95,
+		0x106d, 0x126a, 0x148d, 0x16d8, 0x194b, 0x1be7, 0x1eae, 0x21a2,
+		0x24c2, 0x2811, 0x2b8f, 0x2f3e, 0x331e, 0x3732, 0x3b79, 0x3ff6,
+		0x44a9, 0x4993, 0x4eb6, 0x5412, 0x59a9, 0x5f7c, 0x658b, 0x6bd9,
+		0x7265, 0x7931, 0x803f, 0x878f, 0x8f22, 0x96f9, 0x9f16, 0xa779,
+		0xb024, 0xb917, 0xc253, 0xcbda, 0xd5ad, 0xdfcc, 0xea39, 0xf4f4,
+		0xffff,
+	},
+};
+
+static uint8_t curve = GAMMA_LINEAR;
+static uint8_t white[3] = {255,255,255};
+/* curve and white balance changed but not written to EEPROM yet */
+static uint8_t correction_dirty;
+/* colors as received from the host, before correction */
+static uint16_t raw[3] = {0xff00,0,0};
+
+uint16_t color[3] = {0xff00,0,0};
+uint8_t duty[3] = {255,0,0};
+uint8_t dither[3];
+
+static uchar current_request;
+
+struct device_stats stats = { .version = STATS_VERSION };
+/* consistent copy of the statistics while they are read by the host */
+static struct device_stats report;
+static uchar report_pos;
+
+/* Apply brightness curve and white balance to a channel value; this is
+ * done once when a color is received, not on every PWM tick.
+ */
+static uint16_t correct(uchar ch, uint16_t v) {
+	if (curve != GAMMA_LINEAR) {
+		const uint16_t *p = &gammaCurve[curve-1][v>>10];
+		uint16_t lo = pgm_read_word(p);
+		uint16_t hi = pgm_read_word(p+1);
+		v = lo + (uint16_t)(((uint32_t)(hi-lo) * (uint8_t)(v>>2)) >> 8);
+	}
+	/* scale 0..255 to 0..256 so that 255 leaves the value untouched */
+	return ((uint32_t)v * (white[ch] + (white[ch]>>7))) >> 8;
+}
+
+/* Take over the colors received; color[] is read byte by byte in the
+ * timer interrupt, so the corrected values are computed first and then
+ * copied with interrupts disabled, all channels at once.
+ */
+static void set_colors(const uint16_t v[3]) {
+	uint16_t c[3];
+	uchar i;
+	for (i = 0; i < 3; i++) {
+		raw[i] = v[i];
+		c[i] = correct(i, v[i]);
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		color[0] = c[0];
+		color[1] = c[1];
+		color[2] = c[2];
+	}
+}
+
+void load_correction(void) {
+	uchar i;
+	curve = eeprom_read_byte(EE_GAMMA);
+	if (curve > GAMMA_CURVES)
+		curve = GAMMA_LINEAR;
+	for (i = 0; i < 3; i++) {
+		/* erased cells read as 255, i.e. full scale */
+		white[i] = eeprom_read_byte(EE_WHITE+i);
+	}
+	set_colors(raw);
+}
+
+void save_correction(void) {
+	uchar i;
+	if (!correction_dirty)
+		return;
+	correction_dirty = 0;
+	eeprom_update_byte(EE_GAMMA, curve);
+	for (i = 0; i < 3; i++)
+		eeprom_update_byte(EE_WHITE+i, white[i]);
+}
+
+usbMsgLen_t usbFunctionSetup(uchar data[8]) {
+	usbRequest_t    *rq = (usbRequest_t *)data;
+
+	if((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_VENDOR) {
+		switch(rq->bRequest) {
+			case CUSTOM_RQ_SET_RGB:
+			case CUSTOM_RQ_SET_RGB16:
+			case CUSTOM_RQ_SET_WHITE:
+				current_request = rq->bRequest;
+				return USB_NO_MSG;
+			case CUSTOM_RQ_SET_GAMMA:
+				if (rq->wValue.bytes[0] <= GAMMA_CURVES) {
+					curve = rq->wValue.bytes[0];
+					correction_dirty = 1;
+					set_colors(raw);
+				}
+				return 0;
+			case CUSTOM_RQ_GET_STATS:
+				cli();
+				report = stats;
+				sei();
+				report.osccal = OSCCAL;
+				report_pos = 0;
+				return USB_NO_MSG;
+		}
+	} else {
+		/* calls requests USBRQ_HID_GET_REPORT and USBRQ_HID_SET_REPORT are
+		* not implemented since we never call them. The operating system
+		* won't call them either because our descriptor defines no meaning.
+		*/
+	}
+	return 0;   /* default for not implemented requests: return no data back to host */
+}
+
+uchar usbFunctionRead(uchar *data, uchar len) {
+	uchar i;
+	if (len > sizeof(report) - report_pos)
+		len = sizeof(report) - report_pos;
+	for (i = 0; i < len; i++)
+		data[i] = ((uchar *)&report)[report_pos++];
+	return len;
+}
+
+uchar usbFunctionWrite(uchar *data, uchar len) {
+	uint16_t v[3];
+	uchar i;
+	stats.bytes += len;
+	if (current_request == CUSTOM_RQ_SET_RGB16) {
+		if (len < 6)
+			return 1;
+		for (i = 0; i < 3; i++)
+			v[i] = data[2*i] | data[2*i+1]<<8;
+		set_colors(v);
+		stats.updates++;
+	} else if (current_request == CUSTOM_RQ_SET_WHITE) {
+		if (len < 3)
+			return 1;
+		for (i = 0; i < 3; i++)
+			white[i] = data[i];
+		correction_dirty = 1;
+		set_colors(raw);
+	} else {
+		if (len < 3)
+			return 1;
+		for (i = 0; i < 3; i++)
+			v[i] = data[i]<<8;
+		set_colors(v);
+		stats.updates++;
+	}
+	return 1;
+}
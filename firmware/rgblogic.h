@@ -0,0 +1,84 @@
+/* Interface between the hardware setup in rgbled.c and the device logic
+ * in rgblogic.c.
+ */
+
+#ifndef __RGBLOGIC_H_INCLUDED__
+#define __RGBLOGIC_H_INCLUDED__
+
+#include "requests.h"
+
+/* EEPROM layout */
+#define EE_OSCCAL ((uint8_t *)0)
+#define EE_GAMMA  ((uint8_t *)1)
+#define EE_WHITE  ((uint8_t *)2) /* 3 bytes */
+#define EE_WDT_RESETS ((uint16_t *)5)
+
+/* channel settings in 8.8 fixed point: the upper byte is the PWM duty
+ * cycle, the lower byte the fraction dithered over successive PWM cycles
+ */
+extern uint16_t color[3];
+/* duty cycles used for the current PWM cycle and the dithering error */
+extern uint8_t duty[3];
+extern uint8_t dither[3];
+
+extern struct device_stats stats;
+
+/* read brightness curve and white balance from EEPROM */
+void load_correction(void);
+
+/* Write brightness curve and white balance to EEPROM if they were
+ * changed. Every byte written blocks for 3.4 ms, so this is done from
+ * the main loop and not within the USB callbacks.
+ */
+void save_correction(void);
+
+/* The PWM engine is called from the timer interrupt, so it is kept inline
+ * here; a function call would make the interrupt save all call clobbered
+ * registers on every tick.
+ */
+static inline void set_led(uint8_t cnt, uint8_t setting, volatile uint8_t *port, uint8_t bit) {
+	if (cnt < setting) {
+		*port |= 1<<bit;
+	} else {
+		*port &= ~(1<<bit);
+	}
+}
+
+/* At the start of each PWM cycle, add the fractional part of every
+ * channel to its error accumulator; whenever that overflows, the duty
+ * cycle is raised by one step for this cycle (first order error diffusion).
+ * This runs once every 256 ticks, so the per-tick cost stays the same.
+ */
+static inline void dither_duty(void) {
+	uint8_t i;
+	stats.pwm_cycles++;
+	for (i = 0; i < 3; i++) {
+		uint8_t hi = color[i]>>8;
+		uint8_t lo = color[i];
+		uint8_t err = dither[i] + lo;
+		duty[i] = hi;
+		if (err < lo && hi != 255)
+			duty[i]++;
+		dither[i] = err;
+	}
+}
+
+/* Cost in the timer interrupt, counted on the attiny85 code of the
+ * LLVM AVR backend (avr-gcc -Os differs in detail): the tick running
+ * dither_duty() takes 186 cycles from the first push to reti, 192 with
+ * the interrupt response, other ticks 110. The compare match comes
+ * every 256 cycles (timer 0 free running without prescaler), and the
+ * USB interrupt is held off for as long.
+ */
+static inline void update_leds(void) {
+	static volatile uint8_t cnt = 0;
+	if (cnt == 0)
+		dither_duty();
+	set_led(cnt, duty[0], &PORTB, PB4);
+	set_led(cnt, duty[1], &PORTB, PB3);
+	set_led(cnt, duty[2], &PORTB, PB1);
+	cnt++;
+	cnt %= 256;
+}
+
+#endif /* __RGBLOGIC_H_INCLUDED__ */
@@ -0,0 +1,172 @@
+/* Cycle accurate benchmark of the firmware in simavr.
+ *
+ * Runs rgbled-sim.elf (the firmware linked against sim/usbstub.c) on a
+ * simulated attiny85 and reports the timer interrupt duration, the
+ * longest window with interrupts disabled (which delays the USB
+ * interrupt), PWM frequency and jitter on the red channel and the rate
+ * at which color updates are processed.
+ *
+ * Color updates are requested through PB2 at a fixed rate, independent
+ * of how often the main loop runs; a rate of 0 requests the next update
+ * as soon as the previous one was processed, to find the highest
+ * sustained rate.
+ *
+ * Usage: simbench rgbled-sim.elf [seconds] [updates/s]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_core.h>
+#include <simavr/avr_ioport.h>
+
+#define F_CPU 16500000
+/* byte address of TIMER0_COMPA_vect (vector 10) on the attiny85 */
+#define TIMER0_COMPA_ADDR (10*2)
+
+struct span {
+	unsigned long n;
+	uint64_t min, max, sum;
+};
+
+static void span_add(struct span *s, uint64_t v) {
+	if (s->n == 0 || v < s->min)
+		s->min = v;
+	if (v > s->max)
+		s->max = v;
+	s->sum += v;
+	s->n++;
+}
+
+static struct span pwm_period;
+static uint64_t last_rise;
+static uint32_t red_level;
+static unsigned long updates;
+static uint32_t marker_level;
+/* updates requested through PB2 */
+static unsigned long requests;
+static uint32_t request_level;
+
+/* pin IRQs are raised on every write to the port, only changes count */
+static void red_changed(struct avr_irq_t *irq, uint32_t value, void *param) {
+	avr_t *avr = param;
+	if (value == red_level)
+		return;
+	red_level = value;
+	if (!value)
+		return;
+	if (last_rise)
+		span_add(&pwm_period, avr->cycle - last_rise);
+	last_rise = avr->cycle;
+}
+
+static void update_marker(struct avr_irq_t *irq, uint32_t value, void *param) {
+	if (value == marker_level)
+		return;
+	marker_level = value;
+	updates++;
+}
+
+int main(int argc, char *argv[]) {
+	elf_firmware_t fw = {{0}};
+	avr_t *avr;
+	double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+	double rate = argc > 3 ? atof(argv[3]) : 1000;
+	uint64_t end, start = 0, isr_start = 0, cli_start = 0, next_request = 0;
+	int seen_sei = 0, in_isr = 0, state;
+	struct span isr = {0}, cli = {0};
+	unsigned long start_updates = 0;
+	avr_irq_t *request_pin;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s rgbled-sim.elf [seconds] [updates/s]\n", argv[0]);
+		return 1;
+	}
+	if (elf_read_firmware(argv[1], &fw)) {
+		fprintf(stderr, "Unable to load %s\n", argv[1]);
+		return 1;
+	}
+	avr = avr_make_mcu_by_name("attiny85");
+	if (!avr) {
+		fprintf(stderr, "simavr has no attiny85 core\n");
+		return 1;
+	}
+	avr_init(avr);
+	fw.frequency = F_CPU;
+	avr_load_firmware(avr, &fw);
+
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 4), red_changed, avr);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0), update_marker, avr);
+	request_pin = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2);
+
+	end = (uint64_t)(seconds * F_CPU);
+	do {
+		state = avr_run(avr);
+		if (!seen_sei) {
+			/* boot (USB disconnect delay) ends with the first sei() */
+			if (!avr->sreg[S_I])
+				continue;
+			seen_sei = 1;
+			start = avr->cycle;
+			start_updates = updates;
+			end += start;
+			next_request = start;
+			pwm_period = (struct span){0};
+			last_rise = 0;
+		}
+		if (rate > 0 ? avr->cycle >= next_request : updates - start_updates == requests) {
+			request_level ^= 1;
+			avr_raise_irq(request_pin, request_level);
+			requests++;
+			if (rate > 0)
+				next_request += F_CPU / rate;
+		}
+		if (avr->pc == TIMER0_COMPA_ADDR && !in_isr) {
+			in_isr = 1;
+			isr_start = avr->cycle;
+		}
+		if (avr->sreg[S_I]) {
+			if (cli_start) {
+				span_add(&cli, avr->cycle - cli_start);
+				cli_start = 0;
+			}
+			if (in_isr) {
+				span_add(&isr, avr->cycle - isr_start);
+				in_isr = 0;
+			}
+		} else if (!cli_start) {
+			cli_start = avr->cycle;
+		}
+	} while (avr->cycle < end && state != cpu_Done && state != cpu_Crashed);
+
+	if (state == cpu_Crashed) {
+		fprintf(stderr, "firmware crashed at pc 0x%04x\n", avr->pc);
+		return 1;
+	}
+	if (!seen_sei) {
+		fprintf(stderr, "firmware never enabled interrupts\n");
+		return 1;
+	}
+	seconds = (double)(avr->cycle - start) / F_CPU;
+
+	if (isr.n)
+		printf("timer ISR:         %lu calls, %llu/%.1f/%llu cycles min/avg/max\n",
+				isr.n, (unsigned long long)isr.min, (double)isr.sum / isr.n, (unsigned long long)isr.max);
+	else
+		printf("timer ISR:         not used (PWM runs in the main loop)\n");
+	printf("interrupts off:    longest %llu cycles (%.2f us), %lu windows\n",
+			(unsigned long long)cli.max, cli.max * 1e6 / F_CPU, cli.n);
+	if (pwm_period.n)
+		printf("PWM:               %.1f Hz, period %llu/%.1f/%llu cycles min/avg/max\n",
+				F_CPU / ((double)pwm_period.sum / pwm_period.n),
+				(unsigned long long)pwm_period.min, (double)pwm_period.sum / pwm_period.n,
+				(unsigned long long)pwm_period.max);
+	else
+		printf("PWM:               no edges on PB4\n");
+	printf("updates:           %.0f/s processed (%lu in %.3f s), %lu of %lu requested lost\n",
+			(updates - start_updates) / seconds, updates - start_updates, seconds,
+			requests - (updates - start_updates), requests);
+	return 0;
+}
@@ -0,0 +1,35 @@
+/* Stand-in for the V-USB driver when benchmarking the firmware in
+ * simavr. The simulator requests a color update by toggling PB2 (the
+ * USB interrupt pin, unused without USB) at its own rate; the next
+ * usbPoll() then delivers one SET_RGB transfer through the same
+ * callbacks the driver would use and toggles PB0 (the D- line) so the
+ * simulator can count the updates processed.
+ */
+
+#include <avr/io.h>
+#include "usbdrv.h"
+#include "requests.h"
+
+void usbInit(void) {
+}
+
+void usbPoll(void) {
+	static uchar rgb[3] = {0x80, 0x40, 0x20};
+	static uchar last;
+	uchar setup[8] = {USBRQ_TYPE_VENDOR, CUSTOM_RQ_SET_RGB, 0, 0, 0, 0, 3, 0};
+	uchar request = PINB & 1<<PB2;
+
+	if (request == last)
+		return;
+	last = request;
+	if (usbFunctionSetup(setup) == USB_NO_MSG)
+		usbFunctionWrite(rgb, 3);
+	/* usbDeviceConnect() turned PB0 into an input again */
+	DDRB |= 1<<PB0;
+	PORTB ^= 1<<PB0;
+}
+
+unsigned usbMeasureFrameLength(void) {
+	/* the simulated clock is exact */
+	return (unsigned)(1499 * (double)F_CPU / 10.5e6 + 0.5);
+}
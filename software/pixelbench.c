@@ -0,0 +1,283 @@
+/* Checks the averaging kernels of pixelfilter.c on synthetic images and
+ * measures their cost against the box filter; checks the temporal
+ * filters of pixelsmooth.c on synthetic color sequences.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "pixelfilter.h"
+#include "pixelsmooth.h"
+
+#define SIZE (2*MAX_RADIUS+1)
+
+static struct rgb_color pic[SIZE*SIZE];
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+	if (!ok) {
+		printf("FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(int random) {
+	int i;
+	for (i = 0; i < SIZE*SIZE; i++) {
+		pic[i].red = random ? rand() : 200;
+		pic[i].green = random ? rand() : 100;
+		pic[i].blue = random ? rand() : 50;
+	}
+}
+
+#define SCREEN 512
+
+static struct rgb_color screen[SCREEN*SCREEN];
+
+/* blocks of a few colors with some noise, like a desktop */
+static void fill_screen(void) {
+	static const struct rgb_color palette[4] = {
+		{255, 255, 255, 0}, {0, 0, 0, 0}, {200, 120, 40, 0}, {30, 60, 220, 0}};
+	int x, y;
+	for (y = 0; y < SCREEN; y++) {
+		for (x = 0; x < SCREEN; x++) {
+			struct rgb_color *p = &screen[y*SCREEN+x];
+			*p = palette[(x/24 + y/40 + (x*y/97)) % 4];
+			p->red ^= rand() & 3;
+		}
+	}
+}
+
+/* the window of a cursor wandering over the screen */
+static void wander(int i, int radius, int *x, int *y) {
+	*x = radius + (i*3 + i/7) % (SCREEN-2*radius);
+	*y = radius + (i*2 + i/5) % (SCREEN-2*radius);
+}
+
+/* updates per second of a window following a moving cursor; without a
+ * window the mean is computed from scratch every time
+ */
+static double measure_window(struct window *w, int radius) {
+	struct rgb_color c;
+	volatile int sink = 0;
+	int i, x, y, n = 20000;
+	double t = now();
+	for (i = 0; i < n; i++) {
+		wander(i, radius, &x, &y);
+		if (!w) {
+			filter_area(screen, SCREEN, x-radius, y-radius, x+radius, y+radius, KERNEL_BOX, x, y, radius, &c);
+		} else {
+			window_update(w, screen, SCREEN, 0, 0, x-radius, y-radius, x+radius, y+radius);
+			if (w->histogram)
+				window_dominant(w, &c);
+			else
+				window_mean(w, &c);
+		}
+		sink += c.red;
+	}
+	return n / (now() - t);
+}
+
+/* ns per sample of the kernel with the radius, centered in the image;
+ * the best of a few rounds, the others may have been interrupted
+ */
+static double measure(enum kernel_type k, int radius) {
+	struct rgb_color c;
+	volatile int sink = 0;
+	int i, round, n = 500000 / ((2*radius+1) * (2*radius+1)) + 100;
+	int x = MAX_RADIUS;
+	double best = 0;
+	for (round = 0; round < 5; round++) {
+		double t = now();
+		for (i = 0; i < n; i++) {
+			filter_area(pic, SIZE, x-radius, x-radius, x+radius, x+radius, k, x, x, radius, &c);
+			sink += c.red;
+		}
+		t = (now() - t) / n * 1e9;
+		if (!round || t < best)
+			best = t;
+	}
+	return best;
+}
+
+/* Feed a step from black to grey with some noise, sampled at 1 kHz for
+ * a second; returns the number of colors passed on and the last one.
+ */
+static int smooth_step(const struct smooth_config *cfg, struct rgb_color *last) {
+	struct smoother sm;
+	int i, n = 0;
+
+	memset(&sm, 0, sizeof(sm));
+	for (i = 0; i < 1000; i++) {
+		struct rgb_color c = {0, 0, 0, 0};
+		if (i >= 100)
+			c.red = c.green = c.blue = 128 + (rand() % 5) - 2;
+		/* the noise stops in the end, as the cursor comes to rest */
+		if (i >= 900)
+			c.red = c.green = c.blue = 128;
+		n += smooth_color(cfg, &sm, i * 1000000ULL, 0, &c);
+	}
+	/* what the main loop does once the samples stop */
+	for (i = 0; smooth_pending(&sm) && i < 1000; i++) {
+		struct rgb_color c = sm.input;
+		n += smooth_color(cfg, &sm, (1000 + i) * 1000000ULL, 0, &c);
+	}
+	*last = sm.sent;
+	return n;
+}
+
+int main(void) {
+	static const char *names[N_KERNELS] = {"box", "gauss", "cone", "center", "dominant"};
+	static const int radii[] = {0, 2, 5, 10, 20, MAX_RADIUS};
+	struct rgb_color c;
+	enum kernel_type k;
+	unsigned i;
+	int n;
+
+	/* every kernel keeps a uniform color, also when clipped at a border */
+	fill(0);
+	for (k = 0; k < N_KERNELS; k++) {
+		filter_area(pic, SIZE, 0, 0, 10, 10, k, 5, 5, 5, &c);
+		check(c.red == 200 && c.green == 100 && c.blue == 50, "uniform color");
+		n = filter_area(pic, SIZE, 0, 0, 7, 10, k, 2, 5, 5, &c);
+		check(c.red == 200 && c.green == 100 && c.blue == 50, "uniform color at the border");
+		check(n == 8*11, "pixel count at the border");
+	}
+
+	double lab[3];
+	c.red = c.green = c.blue = 255;
+	oklab(&c, lab);
+	check(fabs(lab[0] - 1) < 1e-3 && fabs(lab[1]) < 1e-3 && fabs(lab[2]) < 1e-3, "OKLab white");
+
+	/* a single bright pixel: the center kernel weighs it most, the box least */
+	for (i = 0; i < SIZE*SIZE; i++)
+		pic[i].red = 0;
+	pic[5*SIZE+5].red = 255;
+	int red[N_KERNELS];
+	for (k = 0; k < N_KERNELS; k++) {
+		filter_area(pic, SIZE, 0, 0, 10, 10, k, 5, 5, 5, &c);
+		red[k] = c.red;
+	}
+	check(red[KERNEL_BOX] == 255/121, "box average");
+	check(red[KERNEL_CENTER] > red[KERNEL_GAUSS] && red[KERNEL_CENTER] > red[KERNEL_CONE] &&
+			red[KERNEL_GAUSS] > red[KERNEL_BOX] && red[KERNEL_CONE] > red[KERNEL_BOX], "kernel order");
+	/* and keeps dominating large areas, the center pixel holds about
+	 * half of the weight
+	 */
+	pic[5*SIZE+5].red = 0;
+	pic[MAX_RADIUS*SIZE+MAX_RADIUS].red = 255;
+	for (i = 20; i <= MAX_RADIUS; i += MAX_RADIUS-20) {
+		int x = MAX_RADIUS;
+		filter_area(pic, SIZE, x-i, x-i, x+i, x+i, KERNEL_CENTER, x, x, i, &c);
+		check(c.red >= 255*2/5 && c.red <= 255*3/5, "center kernel at a large radius");
+	}
+	pic[MAX_RADIUS*SIZE+MAX_RADIUS].red = 0;
+
+	/* a cursor sprite on grey is left out of every kernel and of a window */
+	static struct mask cursor;
+	static struct window w, fresh;
+	for (i = 0; i < SIZE*SIZE; i++)
+		pic[i].red = pic[i].green = pic[i].blue = 128;
+	cursor.width = cursor.height = 8;
+	for (i = 0; i < 8; i++) {
+		memset(cursor.bits[i], 1, i+1);
+		memset(&pic[(20+i)*SIZE+20], 255, (i+1) * sizeof(*pic));
+	}
+	for (k = 0; k < N_KERNELS; k++) {
+		n = filter_area_masked(pic, SIZE, 15, 15, 25, 25, k, 20, 20, 5, &cursor, 20, 20, &c);
+		check(c.red == 128 && c.green == 128 && c.blue == 128, "masked cursor");
+		check(n == 121-21, "masked pixel count");
+	}
+	window_update(&w, pic, SIZE, 0, 0, 15, 15, 25, 25);
+	window_mask(&w, &cursor, 20, 20);
+	window_mean(&w, &c);
+	check(c.red == 128 && w.masked == 36-15, "masked window");
+	window_unmask(&w, &cursor, 20, 20);
+	window_mean(&w, &c);
+	check(c.red > 128, "unmasked window");
+	memset(&w, 0, sizeof(w));
+
+	/* black text on white: the dominant color is white, not grey */
+	for (i = 0; i < SIZE*SIZE; i++)
+		pic[i].red = pic[i].green = pic[i].blue = (i % 3 == 0) ? 0 : 255;
+	w.histogram = 1;
+	window_update(&w, pic, SIZE, 0, 0, 0, 0, 10, 10);
+	window_dominant(&w, &c);
+	check(c.red == 255 && c.green == 255 && c.blue == 255, "dominant color");
+
+	/* a sliding window gives the same colors as counting from scratch */
+	fill_screen();
+	memset(&w, 0, sizeof(w));
+	w.histogram = 1;
+	for (i = 0; i < 1000; i++) {
+		struct rgb_color c2;
+		int x, y;
+		wander(i, 32, &x, &y);
+		window_update(&w, screen, SCREEN, 0, 0, x-32, y-32, x+32, y+32);
+		window_mean(&w, &c);
+		filter_area(screen, SCREEN, x-32, y-32, x+32, y+32, KERNEL_BOX, x, y, 32, &c2);
+		if (c.red != c2.red || c.green != c2.green || c.blue != c2.blue) {
+			check(0, "sliding mean");
+			break;
+		}
+		window_dominant(&w, &c);
+		memset(&fresh, 0, sizeof(fresh));
+		fresh.histogram = 1;
+		window_update(&fresh, screen, SCREEN, 0, 0, x-32, y-32, x+32, y+32);
+		window_dominant(&fresh, &c2);
+		if (c.red != c2.red || c.green != c2.green || c.blue != c2.blue) {
+			check(0, "sliding histogram");
+			break;
+		}
+	}
+	memset(&w, 0, sizeof(w));
+	double full = measure_window(NULL, 32);
+	double mean = measure_window(&w, 32);
+	w.histogram = 1;
+	w.valid = 0;
+	double dominant = measure_window(&w, 32);
+	printf("radius 32, moving cursor: box %.0f updates/s, sliding mean %.0f updates/s, "
+			"sliding dominant %.0f updates/s\n", full, mean, dominant);
+	check(dominant >= 1000, "dominant color at 1 kHz");
+
+	/* the filters end at the input and suppress most of the noise */
+	static const char *filters[] = {"ema:50", "euro:1,0.5"};
+	struct smooth_config cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.step = 3;
+	n = smooth_step(&cfg, &c);
+	printf("step with noise, 1000 samples: %d passed on with step 3 alone", n);
+	for (i = 0; i < sizeof(filters)/sizeof(filters[0]); i++) {
+		check(parse_smooth(filters[i], &cfg), "parse filter");
+		n = smooth_step(&cfg, &c);
+		printf(", %d with %s", n, filters[i]);
+		check(c.red == 128 && c.green == 128 && c.blue == 128, "filter reaches the input");
+		check(n < 100, "filter suppresses noise");
+	}
+	printf("\n");
+
+	fill(1);
+	for (i = 0; i < sizeof(radii)/sizeof(radii[0]); i++) {
+		double box = measure(KERNEL_BOX, radii[i]);
+		printf("radius %2d: box %7.1f ns", radii[i], box);
+		for (k = KERNEL_BOX+1; k < KERNEL_DOMINANT; k++) {
+			double t = measure(k, radii[i]);
+			printf(", %s %7.1f ns (%.2fx)", names[k], t, t / box);
+		}
+		printf("\n");
+	}
+
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,411 @@
+/*
+ * pixelfilter.c
+ *
+ * Box and separable weighted averages, see pixelfilter.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "pixelfilter.h"
+
+static uint8_t weights[N_KERNELS][MAX_RADIUS+1][2*MAX_RADIUS+1];
+static uint8_t computed[N_KERNELS][MAX_RADIUS+1];
+
+int parse_kernel(const char *s, enum kernel_type *k) {
+	static const char *names[N_KERNELS] = {"box", "gauss", "cone", "center", "dominant"};
+	int i;
+	for (i = 0; i < N_KERNELS; i++) {
+		if (strcmp(s, names[i]) == 0) {
+			*k = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static double decode_srgb(double v) {
+	return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+void oklab(const struct rgb_color *c, double lab[3]) {
+	double r = decode_srgb(c->red / 255.0);
+	double g = decode_srgb(c->green / 255.0);
+	double b = decode_srgb(c->blue / 255.0);
+	double l = cbrt(0.4122214708*r + 0.5363325363*g + 0.0514459929*b);
+	double m = cbrt(0.2119034982*r + 0.6806995451*g + 0.1073969566*b);
+	double s = cbrt(0.0883024619*r + 0.2817188376*g + 0.6299787005*b);
+	lab[0] = 0.2104542553*l + 0.7936177850*m - 0.0040720468*s;
+	lab[1] = 1.9779984951*l - 2.4285922050*m + 0.4505937099*s;
+	lab[2] = 0.0259040371*l + 0.7827717662*m - 0.8086757660*s;
+}
+
+const uint8_t *kernel_weights(enum kernel_type k, int radius) {
+	uint8_t *w = weights[k][radius];
+	double sigma = radius > 1 ? radius / 2.0 : 0.5;
+	int d;
+
+	if (computed[k][radius])
+		return w;
+	for (d = -radius; d <= radius; d++) {
+		double v = 1;
+		switch (k) {
+			case KERNEL_BOX:
+				break;
+			case KERNEL_GAUSS:
+				v = exp(-d*d / (2*sigma*sigma));
+				break;
+			case KERNEL_CONE:
+				v = (double)(radius+1 - abs(d)) / (radius+1);
+				break;
+			case KERNEL_CENTER:
+				/* the center pixel keeps about half of the weight at
+				 * every radius: it weighs sqrt(1/2) of its row and
+				 * column, the other pixels share the rest
+				 */
+				v = d ? (1 - M_SQRT1_2) / (M_SQRT1_2 * 2 * radius) : 1;
+				break;
+			default:
+				break;
+		}
+		w[d+radius] = v * 255 < 1 ? 1 : lround(v * 255);
+	}
+	computed[k][radius] = 1;
+	return w;
+}
+
+/* Sums and weight of the masked pixels within x0/y0 - x1/y1, to be
+ * taken off the average; wx and wy are the weights of column x0 and row
+ * y0 as in filter_area(), NULL for the box. The number of masked pixels
+ * is stored in n.
+ */
+static uint64_t masked_sums(const struct rgb_color *pic, int stride, int x0, int y0, int x1, int y1,
+		const uint8_t *wx, const uint8_t *wy, const struct mask *m, int mx, int my,
+		uint64_t sum[3], int *n) {
+	int ax0 = x0 > mx ? x0 : mx, ay0 = y0 > my ? y0 : my;
+	int ax1 = x1 < mx+m->width-1 ? x1 : mx+m->width-1;
+	int ay1 = y1 < my+m->height-1 ? y1 : my+m->height-1;
+	uint64_t weight = 0;
+	int x, y;
+
+	sum[0] = sum[1] = sum[2] = 0;
+	*n = 0;
+	for (y = ay0; y <= ay1; y++) {
+		const uint8_t *bits = m->bits[y-my];
+		for (x = ax0; x <= ax1; x++) {
+			if (!bits[x-mx])
+				continue;
+			const struct rgb_color *p = &pic[y*stride + x];
+			uint32_t v = wx ? wx[x-x0] * wy[y-y0] : 1;
+			sum[0] += p->red * v;
+			sum[1] += p->green * v;
+			sum[2] += p->blue * v;
+			weight += v;
+			(*n)++;
+		}
+	}
+	return weight;
+}
+
+static int filter_box(const struct rgb_color *pic, int stride, int x0, int y0, int x1, int y1,
+		const struct mask *m, int mx, int my, struct rgb_color *c) {
+	unsigned long r = 0, g = 0, b = 0;
+	int x, y;
+
+	for (y = y0; y <= y1; y++) {
+		const struct rgb_color *p = &pic[y*stride];
+		for (x = x0; x <= x1; x++) {
+			r += p[x].red;
+			g += p[x].green;
+			b += p[x].blue;
+		}
+	}
+	int n_pixels = (x1-x0+1) * (y1-y0+1);
+	if (m) {
+		uint64_t masked[3];
+		int n_masked;
+		masked_sums(pic, stride, x0, y0, x1, y1, NULL, NULL, m, mx, my, masked, &n_masked);
+		if (n_masked < n_pixels) {
+			r -= masked[0];
+			g -= masked[1];
+			b -= masked[2];
+			n_pixels -= n_masked;
+		}
+	}
+	c->red = r / n_pixels;
+	c->green = g / n_pixels;
+	c->blue = b / n_pixels;
+	return n_pixels;
+}
+
+int filter_area(const struct rgb_color *pic, int stride, int x0, int y0, int x1, int y1,
+		enum kernel_type k, int cx, int cy, int radius, struct rgb_color *c) {
+	return filter_area_masked(pic, stride, x0, y0, x1, y1, k, cx, cy, radius, NULL, 0, 0, c);
+}
+
+int filter_area_masked(const struct rgb_color *pic, int stride, int x0, int y0, int x1, int y1,
+		enum kernel_type k, int cx, int cy, int radius,
+		const struct mask *m, int mx, int my, struct rgb_color *c) {
+	const uint8_t *w;
+	uint64_t r = 0, g = 0, b = 0;
+	uint32_t sum_x = 0, sum_y = 0;
+	int x, y, n_pixels;
+
+	if (k != KERNEL_BOX) {
+		/* only what the kernel covers */
+		if (x0 < cx-radius) x0 = cx-radius;
+		if (y0 < cy-radius) y0 = cy-radius;
+		if (x1 > cx+radius) x1 = cx+radius;
+		if (y1 > cy+radius) y1 = cy+radius;
+	}
+	if (x1 < x0 || y1 < y0)
+		return 0;
+	/* a single pixel needs no weights; without a histogram the dominant
+	 * color is approximated by the mean
+	 */
+	if (k == KERNEL_BOX || k == KERNEL_DOMINANT || radius == 0 || radius > MAX_RADIUS)
+		return filter_box(pic, stride, x0, y0, x1, y1, m, mx, my, c);
+
+	/* wx[0] and wy[0] are the weights of column x0 and row y0 */
+	w = kernel_weights(k, radius);
+	const uint8_t *wx = &w[x0 - cx + radius];
+	const uint8_t *wy = &w[y0 - cy + radius];
+	int n = x1-x0+1;
+	for (x = 0; x < n; x++)
+		sum_x += wx[x];
+	for (y = y0; y <= y1; y++) {
+		const struct rgb_color *p = &pic[y*stride + x0];
+		/* at most 129 * 255 * 255 per row, fits into 32 bits */
+		uint32_t rr = 0, rg = 0, rb = 0;
+		for (x = 0; x < n; x++) {
+			rr += p[x].red * wx[x];
+			rg += p[x].green * wx[x];
+			rb += p[x].blue * wx[x];
+		}
+		r += (uint64_t)rr * wy[y-y0];
+		g += (uint64_t)rg * wy[y-y0];
+		b += (uint64_t)rb * wy[y-y0];
+		sum_y += wy[y-y0];
+	}
+	uint64_t total = (uint64_t)sum_x * sum_y;
+	n_pixels = n * (y1-y0+1);
+	if (m) {
+		uint64_t masked[3];
+		int n_masked;
+		uint64_t weight = masked_sums(pic, stride, x0, y0, x1, y1, wx, wy, m, mx, my, masked, &n_masked);
+		if (n_masked < n_pixels) {
+			r -= masked[0];
+			g -= masked[1];
+			b -= masked[2];
+			total -= weight;
+			n_pixels -= n_masked;
+		}
+	}
+	c->red = (r + total/2) / total;
+	c->green = (g + total/2) / total;
+	c->blue = (b + total/2) / total;
+	return n_pixels;
+}
+
+#define WIN (2*MAX_RADIUS+1)
+
+static inline int bucket(const struct rgb_color *p) {
+	return (p->red >> (8-HIST_BITS)) << 2*HIST_BITS |
+		(p->green >> (8-HIST_BITS)) << HIST_BITS |
+		p->blue >> (8-HIST_BITS);
+}
+
+/* count or uncount (d = -1) the pixels of a rectangle; counted pixels
+ * are read from the image, uncounted ones from what was counted before
+ */
+static inline void count_rect(struct window *w, const struct rgb_color *pic, int stride, int ox, int oy,
+		int x0, int y0, int x1, int y1, const int d, const int histogram) {
+	/* a row wraps around the end of the kept window at most once */
+	int i0 = x0 % WIN, n = x1-x0+1;
+	int n0 = n < WIN-i0 ? n : WIN-i0;
+	int x, y, part;
+	for (y = y0; y <= y1; y++) {
+		/* only counted pixels are read from the image */
+		const struct rgb_color *src = d > 0 ? &pic[(y-oy)*stride + x0-ox] : NULL;
+		uint32_t r = 0, g = 0, b = 0;
+		for (part = 0; part < 2; part++) {
+			struct rgb_color *p = part ? w->px[y % WIN] : &w->px[y % WIN][i0];
+			int len = part ? n-n0 : n0;
+			if (d > 0)
+				memcpy(p, part ? src+n0 : src, len * sizeof(*p));
+			for (x = 0; x < len; x++) {
+				r += p[x].red;
+				g += p[x].green;
+				b += p[x].blue;
+				if (histogram) {
+					int k = bucket(&p[x]);
+					w->count[k] += d;
+					w->bucket_sum[k][0] += d * p[x].red;
+					w->bucket_sum[k][1] += d * p[x].green;
+					w->bucket_sum[k][2] += d * p[x].blue;
+				}
+			}
+		}
+		w->sum[0] += d * r;
+		w->sum[1] += d * g;
+		w->sum[2] += d * b;
+	}
+}
+
+/* the variants with constant arguments are optimized separately */
+static void window_rect(struct window *w, const struct rgb_color *pic, int stride, int ox, int oy,
+		int x0, int y0, int x1, int y1, int d) {
+	if (w->histogram) {
+		if (d > 0)
+			count_rect(w, pic, stride, ox, oy, x0, y0, x1, y1, 1, 1);
+		else
+			count_rect(w, pic, stride, ox, oy, x0, y0, x1, y1, -1, 1);
+	} else {
+		if (d > 0)
+			count_rect(w, pic, stride, ox, oy, x0, y0, x1, y1, 1, 0);
+		else
+			count_rect(w, pic, stride, ox, oy, x0, y0, x1, y1, -1, 0);
+	}
+}
+
+/* the parts of rectangle a that are not in b (of the same size): at
+ * most a strip of rows and a strip of columns
+ */
+static int rect_diff(const struct rect *a, const struct rect *b, struct rect *out) {
+	int n = 0;
+	int y0 = a->y0 > b->y0 ? a->y0 : b->y0, y1 = a->y1 < b->y1 ? a->y1 : b->y1;
+	/* whole rows above and below b */
+	if (a->y0 < b->y0)
+		out[n++] = (struct rect){a->x0, a->y0, a->x1, b->y0-1 < a->y1 ? b->y0-1 : a->y1};
+	if (a->y1 > b->y1)
+		out[n++] = (struct rect){a->x0, b->y1+1 > a->y0 ? b->y1+1 : a->y0, a->x1, a->y1};
+	/* columns left and right of b within the rows both share */
+	if (y0 > y1)
+		return n;
+	if (a->x0 < b->x0)
+		out[n++] = (struct rect){a->x0, y0, b->x0-1 < a->x1 ? b->x0-1 : a->x1, y1};
+	if (a->x1 > b->x1)
+		out[n++] = (struct rect){b->x1+1 > a->x0 ? b->x1+1 : a->x0, y0, a->x1, y1};
+	return n;
+}
+
+int window_slide(struct window *w, const struct rect *r, struct rect *enter) {
+	struct rect leave[2];
+	int i, n;
+
+	if (!w->valid || r->x1-r->x0 != w->r.x1-w->r.x0 || r->y1-r->y0 != w->r.y1-w->r.y0 ||
+			(r->x0 == w->r.x0 && r->y0 == w->r.y0) ||
+			r->x0 > w->r.x1 || r->x1 < w->r.x0 || r->y0 > w->r.y1 || r->y1 < w->r.y0 ||
+			++w->slides >= WINDOW_REFRESH)
+		return -1;
+	n = rect_diff(&w->r, r, leave);
+	for (i = 0; i < n; i++)
+		window_rect(w, NULL, 0, 0, 0, leave[i].x0, leave[i].y0, leave[i].x1, leave[i].y1, -1);
+	n = rect_diff(r, &w->r, enter);
+	w->r = *r;
+	return n;
+}
+
+void window_reset(struct window *w, const struct rect *r) {
+	memset(w->sum, 0, sizeof(w->sum));
+	if (w->histogram) {
+		memset(w->count, 0, sizeof(w->count));
+		memset(w->bucket_sum, 0, sizeof(w->bucket_sum));
+	}
+	w->valid = 1;
+	w->slides = 0;
+	w->masked = 0;
+	w->r = *r;
+}
+
+void window_add(struct window *w, const struct rgb_color *pic, int stride, int ox, int oy,
+		const struct rect *r) {
+	window_rect(w, pic, stride, ox, oy, r->x0, r->y0, r->x1, r->y1, 1);
+}
+
+int window_update(struct window *w, const struct rgb_color *pic, int stride, int ox, int oy,
+		int x0, int y0, int x1, int y1) {
+	struct rect r = {x0, y0, x1, y1}, enter[2];
+	int i, n;
+
+	if (x1 < x0 || y1 < y0 || x1-x0 >= WIN || y1-y0 >= WIN)
+		return 0;
+	n = window_slide(w, &r, enter);
+	if (n < 0) {
+		window_reset(w, &r);
+		window_add(w, pic, stride, ox, oy, &r);
+	}
+	for (i = 0; i < n; i++)
+		window_add(w, pic, stride, ox, oy, &enter[i]);
+	return (x1-x0+1) * (y1-y0+1);
+}
+
+void window_mean(const struct window *w, struct rgb_color *c) {
+	uint32_t n = (w->r.x1-w->r.x0+1) * (w->r.y1-w->r.y0+1) - w->masked;
+	c->red = w->sum[0] / n;
+	c->green = w->sum[1] / n;
+	c->blue = w->sum[2] / n;
+}
+
+void window_dominant(const struct window *w, struct rgb_color *c) {
+	int i, peak = 0;
+	for (i = 1; i < HIST_BUCKETS; i++) {
+		if (w->count[i] > w->count[peak])
+			peak = i;
+	}
+	c->red = w->bucket_sum[peak][0] / w->count[peak];
+	c->green = w->bucket_sum[peak][1] / w->count[peak];
+	c->blue = w->bucket_sum[peak][2] / w->count[peak];
+}
+
+/* count (d = 1) or uncount (d = -1) the kept pixels of the window
+ * covered by the mask, returns their number
+ */
+static int mask_window(struct window *w, const struct mask *m, int mx, int my, int d) {
+	int x0 = w->r.x0 > mx ? w->r.x0 : mx, y0 = w->r.y0 > my ? w->r.y0 : my;
+	int x1 = w->r.x1 < mx+m->width-1 ? w->r.x1 : mx+m->width-1;
+	int y1 = w->r.y1 < my+m->height-1 ? w->r.y1 : my+m->height-1;
+	int x, y, n = 0;
+
+	for (y = y0; y <= y1; y++) {
+		for (x = x0; x <= x1; x++) {
+			if (!m->bits[y-my][x-mx])
+				continue;
+			const struct rgb_color *p = &w->px[y % WIN][x % WIN];
+			n++;
+			if (!d)
+				continue;
+			w->sum[0] += d * p->red;
+			w->sum[1] += d * p->green;
+			w->sum[2] += d * p->blue;
+			if (w->histogram) {
+				int k = bucket(p);
+				w->count[k] += d;
+				w->bucket_sum[k][0] += d * p->red;
+				w->bucket_sum[k][1] += d * p->green;
+				w->bucket_sum[k][2] += d * p->blue;
+			}
+		}
+	}
+	return n;
+}
+
+void window_mask(struct window *w, const struct mask *m, int mx, int my) {
+	int n;
+
+	if (!w->valid || w->masked)
+		return;
+	n = mask_window(w, m, mx, my, 0);
+	if (!n || n >= (w->r.x1-w->r.x0+1) * (w->r.y1-w->r.y0+1))
+		return;
+	mask_window(w, m, mx, my, -1);
+	w->masked = n;
+}
+
+void window_unmask(struct window *w, const struct mask *m, int mx, int my) {
+	if (!w->masked)
+		return;
+	mask_window(w, m, mx, my, 1);
+	w->masked = 0;
+}
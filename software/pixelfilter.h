@@ -0,0 +1,129 @@
+/*
+ * pixelfilter.h
+ *
+ * Averaging of captured pixels, either uniformly (box) or weighted by a
+ * kernel around a center pixel. The weighted kernels are separable: the
+ * weight of a pixel is wx * wy, so every row is reduced first and the
+ * row sums are then weighted once more.
+ */
+
+#ifndef __PIXELFILTER_H_INCLUDED__
+#define __PIXELFILTER_H_INCLUDED__
+
+#include "pixeltrack.h"
+
+enum kernel_type {
+	KERNEL_BOX,      /* all pixels alike */
+	KERNEL_GAUSS,    /* gaussian, sigma = radius/2 */
+	KERNEL_CONE,     /* weights falling linearly to the border */
+	KERNEL_CENTER,   /* the center pixel dominates */
+	KERNEL_DOMINANT, /* the most common color, see struct window */
+	N_KERNELS
+};
+
+/* parse "box", "gauss", "cone", "center" or "dominant" */
+int parse_kernel(const char *s, enum kernel_type *k);
+
+/* the OKLab coordinates (L, a, b) of an sRGB color */
+void oklab(const struct rgb_color *c, double lab[3]);
+
+/* weights (1..255) of a kernel for offsets -radius..radius from the
+ * center, computed once per kernel and radius
+ */
+const uint8_t *kernel_weights(enum kernel_type k, int radius);
+
+/* Average the pixels x0/y0 - x1/y1 (inclusive, within the image) of an
+ * image with stride pixels per row. Weighted kernels are centered at
+ * cx/cy with the given radius; pixels outside of it are not counted.
+ * Returns the number of pixels averaged.
+ */
+int filter_area(const struct rgb_color *pic, int stride, int x0, int y0, int x1, int y1,
+		enum kernel_type k, int cx, int cy, int radius, struct rgb_color *c);
+
+/* pixels left out of an average, like those under the cursor sprite:
+ * a pixel is masked if its byte is not 0
+ */
+#define MASK_SIZE 128
+
+struct mask {
+	int width;
+	int height;
+	uint8_t bits[MASK_SIZE][MASK_SIZE];
+};
+
+/* filter_area() without the pixels of mask m, whose upper left corner is
+ * at mx/my of the image. If all pixels are masked, none is left out.
+ */
+int filter_area_masked(const struct rgb_color *pic, int stride, int x0, int y0, int x1, int y1,
+		enum kernel_type k, int cx, int cy, int radius,
+		const struct mask *m, int mx, int my, struct rgb_color *c);
+
+/* a rectangle in screen coordinates, inclusive */
+struct rect {
+	int x0, y0, x1, y1;
+};
+
+/* A window following a pointer: when it slides, only the pixels leaving
+ * and entering it are counted, so a move of a few pixels costs O(radius)
+ * instead of O(radius^2). The counted pixels are kept (indexed by screen
+ * position modulo the size), so uncounting always undoes exactly what
+ * was counted.
+ *
+ * Besides the channel sums for the mean, a histogram may be kept for the
+ * dominant color: pixels are counted in buckets of their upper HIST_BITS
+ * bits per channel, the color is the mean of the fullest bucket.
+ */
+#define HIST_BITS 4
+#define HIST_BUCKETS (1 << 3*HIST_BITS)
+/* windows slid that often are counted from scratch again, to pick up
+ * changes of the screen content in the overlap
+ */
+#define WINDOW_REFRESH 8
+
+struct window {
+	struct rgb_color px[2*MAX_RADIUS+1][2*MAX_RADIUS+1];
+	/* the window counted */
+	int valid;
+	struct rect r;
+	int slides;
+	/* pixels left out by window_mask() */
+	int masked;
+	uint32_t sum[3];
+	/* keep the histogram too */
+	int histogram;
+	uint16_t count[HIST_BUCKETS];
+	uint32_t bucket_sum[HIST_BUCKETS][3];
+};
+
+/* Move the window to x0/y0 - x1/y1 (screen coordinates, inclusive, at
+ * most 2*MAX_RADIUS+1 pixels wide and high) of an image captured at
+ * ox/oy. A window at the same position or of another size is counted
+ * from scratch. Returns the number of pixels in the window.
+ */
+int window_update(struct window *w, const struct rgb_color *pic, int stride, int ox, int oy,
+		int x0, int y0, int x1, int y1);
+
+/* The same in steps, for pixels captured piecewise: window_slide()
+ * moves the window to r and uncounts the pixels leaving it, returning
+ * the (at most two) rectangles entering it, to be counted with
+ * window_add(). If the window has to be counted from scratch instead it
+ * returns -1 and leaves the window alone; window_reset() then empties it
+ * at r and window_add() counts all of r.
+ */
+int window_slide(struct window *w, const struct rect *r, struct rect *enter);
+void window_reset(struct window *w, const struct rect *r);
+void window_add(struct window *w, const struct rgb_color *pic, int stride, int ox, int oy,
+		const struct rect *r);
+
+/* mean and dominant color of an updated window */
+void window_mean(const struct window *w, struct rgb_color *c);
+void window_dominant(const struct window *w, struct rgb_color *c);
+
+/* leave the pixels of mask m at mx/my (screen coordinates) out of the
+ * colors of the window, unless they are all of it; the window must be
+ * unmasked again before it is moved
+ */
+void window_mask(struct window *w, const struct mask *m, int mx, int my);
+void window_unmask(struct window *w, const struct mask *m, int mx, int my);
+
+#endif /* __PIXELFILTER_H_INCLUDED__ */
@@ -0,0 +1,50 @@
+/*
+ * pixelring.c
+ *
+ * Writer side of the shared memory sample ring, see pixelring.h
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "pixelring.h"
+
+struct pixel_ring *pixel_ring_create(const char *name) {
+	struct pixel_ring *ring;
+	int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if (fd < 0) {
+		perror("Unable to create shared memory ring");
+		return NULL;
+	}
+	if (ftruncate(fd, sizeof(*ring)) != 0) {
+		perror("Unable to size shared memory ring");
+		close(fd);
+		return NULL;
+	}
+	ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED) {
+		perror("Unable to map shared memory ring");
+		return NULL;
+	}
+	/* readers of a previous run see the ring restart from zero */
+	atomic_store(&ring->head, 0);
+	ring->magic = PIXEL_RING_MAGIC;
+	ring->version = PIXEL_RING_VERSION;
+	ring->slots = PIXEL_RING_SLOTS;
+	return ring;
+}
+
+void pixel_ring_publish(struct pixel_ring *ring, const struct pixel_sample *s) {
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	struct pixel_ring_slot *slot = &ring->slot[head % PIXEL_RING_SLOTS];
+	uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memcpy(&slot->sample, s, sizeof(*s));
+	atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
@@ -0,0 +1,97 @@
+/*
+ * pixelring.h
+ *
+ * Layout of the POSIX shared memory ring in which pixeltrack publishes
+ * every sample (see -s), and a lock free reader for other processes:
+ *
+ *   int fd = shm_open("/pixeltrack", O_RDONLY, 0);
+ *   struct pixel_ring *ring = mmap(NULL, sizeof(*ring), PROT_READ, MAP_SHARED, fd, 0);
+ *   struct pixel_sample s;
+ *   if (pixel_ring_latest(ring, &s)) ...
+ *
+ * Each slot is guarded by a sequence counter that is odd while the slot
+ * is being written; readers retry until they see the same even value
+ * before and after copying the sample. Reading needs no system calls.
+ */
+
+#ifndef __PIXELRING_H_INCLUDED__
+#define __PIXELRING_H_INCLUDED__
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#define PIXEL_RING_MAGIC   0x50585247 /* "PXRG" */
+#define PIXEL_RING_VERSION 1
+/* number of slots, a power of two */
+#define PIXEL_RING_SLOTS   256
+
+struct pixel_sample {
+	uint64_t time_ns;     /* CLOCK_MONOTONIC */
+	int32_t x;            /* cursor position, or zone origin */
+	int32_t y;
+	uint16_t source;      /* 0 is the cursor */
+	uint8_t red;
+	uint8_t green;
+	uint8_t blue;
+	uint8_t reserved[3];
+	/* the averaged window */
+	uint16_t width;
+	uint16_t height;
+	uint32_t n_pixels;
+};
+
+struct pixel_ring_slot {
+	_Atomic uint32_t seq;
+	uint32_t reserved;
+	struct pixel_sample sample;
+};
+
+struct pixel_ring {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t reserved;
+	/* number of samples published so far */
+	_Atomic uint64_t head;
+	struct pixel_ring_slot slot[PIXEL_RING_SLOTS];
+};
+
+/* Read sample number n (counting from 0); returns 0 if it has not been
+ * published yet or was already overwritten.
+ */
+static inline int pixel_ring_read(const struct pixel_ring *ring, uint64_t n, struct pixel_sample *s) {
+	const struct pixel_ring_slot *slot = &ring->slot[n % PIXEL_RING_SLOTS];
+	uint32_t seq;
+	uint64_t head;
+
+	do {
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if (n >= head || head - n > PIXEL_RING_SLOTS)
+			return 0;
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq & 1)
+			continue;
+		memcpy(s, &slot->sample, sizeof(*s));
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) || atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq);
+	/* the writer may have lapped us while we were copying */
+	return atomic_load_explicit(&ring->head, memory_order_acquire) - n <= PIXEL_RING_SLOTS;
+}
+
+/* read the most recent sample, returns 0 if there is none yet */
+static inline int pixel_ring_latest(const struct pixel_ring *ring, struct pixel_sample *s) {
+	uint64_t head;
+	do {
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if (head == 0)
+			return 0;
+	} while (!pixel_ring_read(ring, head - 1, s));
+	return 1;
+}
+
+/* writer side, used by pixeltrack */
+struct pixel_ring *pixel_ring_create(const char *name);
+void pixel_ring_publish(struct pixel_ring *ring, const struct pixel_sample *s);
+
+#endif /* __PIXELRING_H_INCLUDED__ */
@@ -0,0 +1,59 @@
+/*
+ * pixelsend.c
+ *
+ * Sends colors, given as red/green/blue (0-255), to the first PhysPixel
+ * found, one after the other:
+ *
+ *   ./pixelsend 255/0/0 0/255/0 0/0/255
+ *
+ * Used by virtcheck.sh to drive virtpixel.
+ */
+
+#include <stdio.h>
+#include <libusb.h>
+
+#include "../firmware/requests.h"
+
+#define USB_VENDOR_ID  0x16c0
+#define USB_PRODUCT_ID 0x05df
+#define USB_TIMEOUT 1000
+
+int main(int argc, char *argv[]) {
+	libusb_device_handle *handle;
+	unsigned char rgb[3];
+	unsigned r, g, b;
+	int i, ret = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s red/green/blue...\n", argv[0]);
+		return 1;
+	}
+	if (libusb_init(NULL) != 0) {
+		fprintf(stderr, "Unable to initialize libusb\n");
+		return 1;
+	}
+	handle = libusb_open_device_with_vid_pid(NULL, USB_VENDOR_ID, USB_PRODUCT_ID);
+	if (!handle) {
+		fprintf(stderr, "No PhysPixel found\n");
+		libusb_exit(NULL);
+		return 1;
+	}
+	for (i = 1; i < argc && !ret; i++) {
+		if (sscanf(argv[i], "%u/%u/%u", &r, &g, &b) != 3 || r > 255 || g > 255 || b > 255) {
+			fprintf(stderr, "Invalid color: %s\n", argv[i]);
+			ret = 1;
+			break;
+		}
+		rgb[0] = r;
+		rgb[1] = g;
+		rgb[2] = b;
+		if (libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
+				CUSTOM_RQ_SET_RGB, 0, 0, rgb, 3, USB_TIMEOUT) != 3) {
+			fprintf(stderr, "Unable to send %s\n", argv[i]);
+			ret = 1;
+		}
+	}
+	libusb_close(handle);
+	libusb_exit(NULL);
+	return ret;
+}
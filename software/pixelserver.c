@@ -0,0 +1,249 @@
+/*
+ * pixelserver.c
+ *
+ * Unix domain socket server for subscribers, see pixelserver.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "pixelserver.h"
+#include "pixelstream.h"
+
+struct client {
+	int fd;
+	/* source subscribed to, -1 for all */
+	int source;
+	/* minimum time between two samples of a source, 0 for no limit */
+	uint64_t interval;
+	uint64_t last[MAX_SOURCES];
+	/* encoded records waiting to be sent */
+	unsigned char queue[CLIENT_QUEUE][PIXEL_STREAM_RECORD];
+	int head;
+	int count;
+	/* bytes of the record at head already sent */
+	int sent;
+	unsigned long dropped;
+	/* the subscriber that set the radius, no one else may change it */
+	int radius_owner;
+	/* sending failed; closed by server_poll(), not while samples are
+	 * being put out
+	 */
+	int dead;
+	/* request line being received */
+	char line[64];
+	int line_len;
+};
+
+static int listen_fd = -1;
+static server_source_fn add_source = NULL;
+static server_release_fn release_source = NULL;
+static server_radius_fn set_radius = NULL;
+static struct client clients[MAX_CLIENTS];
+static int n_clients = 0;
+static int radius_owned = 0;
+
+int server_open(const char *path, server_source_fn source_fn, server_release_fn release_fn,
+		server_radius_fn radius_fn) {
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return 0;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		perror("Unable to create socket");
+		return 0;
+	}
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+			listen(listen_fd, MAX_CLIENTS) != 0) {
+		perror("Unable to listen on socket");
+		close(listen_fd);
+		listen_fd = -1;
+		return 0;
+	}
+	fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+	add_source = source_fn;
+	release_source = release_fn;
+	set_radius = radius_fn;
+	return 1;
+}
+
+static void close_client(int i) {
+	close(clients[i].fd);
+	release_source(clients[i].source);
+	if (clients[i].radius_owner)
+		radius_owned = 0;
+	if (clients[i].dropped)
+		fprintf(stderr, "Subscriber dropped %lu samples\n", clients[i].dropped);
+	clients[i] = clients[--n_clients];
+}
+
+static void accept_clients(void) {
+	unsigned char header[PIXEL_STREAM_HEADER];
+	struct client *c;
+	int fd;
+
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		if (n_clients == MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		/* the header always fits into the socket buffer of a new connection */
+		memcpy(header, PIXEL_STREAM_MAGIC, 4);
+		header[4] = PIXEL_STREAM_VERSION;
+		header[5] = PIXEL_STREAM_VERSION >> 8;
+		header[6] = PIXEL_STREAM_RECORD;
+		header[7] = PIXEL_STREAM_RECORD >> 8;
+		if (send(fd, header, sizeof(header), MSG_NOSIGNAL) != sizeof(header)) {
+			close(fd);
+			continue;
+		}
+		c = &clients[n_clients++];
+		memset(c, 0, sizeof(*c));
+		c->fd = fd;
+		c->source = -1;
+	}
+}
+
+/* send as much of the queue as the socket takes, returns 0 if the
+ * subscriber is gone
+ */
+static int flush_client(struct client *c) {
+	while (c->count) {
+		/* the records up to the end of the queue are contiguous */
+		int run = c->count < CLIENT_QUEUE - c->head ? c->count : CLIENT_QUEUE - c->head;
+		ssize_t n = send(c->fd, c->queue[c->head] + c->sent,
+				run * PIXEL_STREAM_RECORD - c->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		c->sent += n;
+		c->head = (c->head + c->sent / PIXEL_STREAM_RECORD) % CLIENT_QUEUE;
+		c->count -= c->sent / PIXEL_STREAM_RECORD;
+		c->sent %= PIXEL_STREAM_RECORD;
+	}
+	return 1;
+}
+
+static void handle_line(struct client *c, const char *line) {
+	struct source src;
+	int rate, radius;
+
+	if (sscanf(line, "radius %d", &radius) == 1) {
+		if (radius_owned && !c->radius_owner)
+			fprintf(stderr, "Radius set by another subscriber, ignoring radius %d\n", radius);
+		else if (!set_radius(radius))
+			fprintf(stderr, "Radius fixed on the command line, ignoring radius %d\n", radius);
+		else
+			radius_owned = c->radius_owner = 1;
+	} else if (sscanf(line, "rate %d", &rate) == 1) {
+		c->interval = rate > 0 ? 1000000000ULL / rate : 0;
+		memset(c->last, 0, sizeof(c->last));
+	} else if (strcmp(line, "all") == 0) {
+		release_source(c->source);
+		c->source = -1;
+	} else if (parse_source(line, &src)) {
+		/* added before the old one is released, in case it is the same */
+		int source = add_source(&src);
+		release_source(c->source);
+		c->source = source;
+		if (c->source < 0)
+			fprintf(stderr, "Unable to track source %s for subscriber\n", line);
+	}
+}
+
+/* read and handle request lines, returns 0 if the subscriber is gone */
+static int read_client(struct client *c) {
+	char buf[256];
+	ssize_t n, i;
+
+	while ((n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (buf[i] == '\n') {
+				/* overlong lines are discarded */
+				if (c->line_len < (int)sizeof(c->line)) {
+					c->line[c->line_len] = '\0';
+					handle_line(c, c->line);
+				}
+				c->line_len = 0;
+			} else if (c->line_len < (int)sizeof(c->line)) {
+				c->line[c->line_len++] = buf[i];
+			}
+		}
+	}
+	if (n == 0)
+		return 0;
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+void server_poll(void) {
+	int i;
+
+	if (listen_fd < 0)
+		return;
+	accept_clients();
+	for (i = 0; i < n_clients; i++) {
+		if (clients[i].dead || !read_client(&clients[i]) || !flush_client(&clients[i]))
+			close_client(i--);
+	}
+}
+
+int server_pollfds(struct pollfd *fds, int max) {
+	int i, n = 0;
+
+	if (listen_fd < 0 || max < 1)
+		return 0;
+	fds[n].fd = listen_fd;
+	fds[n++].events = POLLIN;
+	for (i = 0; i < n_clients && n < max; i++) {
+		fds[n].fd = clients[i].fd;
+		fds[n++].events = POLLIN | (clients[i].count ? POLLOUT : 0);
+	}
+	return n;
+}
+
+static void enqueue(struct client *c, const struct sample *s) {
+	if (c->count == CLIENT_QUEUE) {
+		/* drop the oldest record, unless it is partly sent already:
+		 * then it takes the place of the next one
+		 */
+		int next = (c->head + 1) % CLIENT_QUEUE;
+		if (c->sent)
+			memcpy(c->queue[next], c->queue[c->head], PIXEL_STREAM_RECORD);
+		c->head = next;
+		c->count--;
+		c->dropped++;
+	}
+	pixel_stream_encode(c->queue[(c->head + c->count) % CLIENT_QUEUE], s);
+	c->count++;
+}
+
+void server_send(const struct sample *s) {
+	int i;
+
+	for (i = 0; i < n_clients; i++) {
+		struct client *c = &clients[i];
+		if (c->dead || (c->source >= 0 && c->source != s->source))
+			continue;
+		if (c->interval && s->source < MAX_SOURCES) {
+			if (s->time_ns - c->last[s->source] < c->interval)
+				continue;
+			c->last[s->source] = s->time_ns;
+		}
+		enqueue(c, s);
+		if (!flush_client(c))
+			c->dead = 1;
+	}
+}
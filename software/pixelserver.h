@@ -0,0 +1,64 @@
+/*
+ * pixelserver.h
+ *
+ * Unix domain socket server pushing samples to any number of
+ * subscribers. A subscriber first receives the header of the binary
+ * stream (see pixelstream.h), followed by a record for every sample.
+ * It may send lines to narrow down what it gets:
+ *
+ *   cursor | pointer:ID | zone:X,Y,WxH   only samples of that source;
+ *                                        pointers and zones not tracked
+ *                                        yet are added; zones are clipped
+ *                                        to the screen, larger ones are
+ *                                        refused
+ *   all                                  samples of all sources (default)
+ *   rate HZ                              at most HZ samples per second
+ *                                        and source, 0 for no limit
+ *   radius N                             sample N pixels around pointers,
+ *                                        for all subscribers; only the
+ *                                        first subscriber to ask may change
+ *                                        it, until it disconnects
+ *
+ * Every subscriber has a bounded queue; when it is full the oldest
+ * record is dropped, so a slow subscriber never holds up the capture.
+ */
+
+#ifndef __PIXELSERVER_H_INCLUDED__
+#define __PIXELSERVER_H_INCLUDED__
+
+#include <poll.h>
+#include "pixeltrack.h"
+
+/* subscribers handled at the same time */
+#define MAX_CLIENTS 16
+/* records queued per subscriber */
+#define CLIENT_QUEUE 64
+
+/* returns the number of the source a subscriber asked for, adding it if
+ * necessary, or -1 if it cannot be tracked; every source returned is
+ * released again once the subscriber no longer wants it
+ */
+typedef int (*server_source_fn)(const struct source *src);
+typedef void (*server_release_fn)(int source);
+/* changes the sampling radius, returns 0 if that is not allowed */
+typedef int (*server_radius_fn)(int radius);
+
+/* listen on the socket path, replacing a stale socket */
+int server_open(const char *path, server_source_fn add_source, server_release_fn release_source,
+		server_radius_fn set_radius);
+
+/* accept subscribers, read their requests and send queued records;
+ * never blocks
+ */
+void server_poll(void);
+
+/* file descriptors to wait for before calling server_poll() again */
+int server_pollfds(struct pollfd *fds, int max);
+
+/* queue a sample for all subscribers interested in it; subscribers
+ * gone are only closed (and their sources released) by server_poll(),
+ * so this is safe while samples are being put out
+ */
+void server_send(const struct sample *s);
+
+#endif /* __PIXELSERVER_H_INCLUDED__ */
@@ -0,0 +1,97 @@
+/*
+ * pixelsmooth.c
+ *
+ * Temporal filter for sampled colors, see pixelsmooth.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "pixelsmooth.h"
+
+int parse_smooth(const char *s, struct smooth_config *cfg) {
+	if (sscanf(s, "ema:%lf", &cfg->tau) == 1 && cfg->tau > 0) {
+		cfg->type = SMOOTH_EMA;
+		return 1;
+	}
+	cfg->beta = 0;
+	if (sscanf(s, "euro:%lf,%lf", &cfg->min_cutoff, &cfg->beta) >= 1 &&
+			cfg->min_cutoff > 0 && cfg->beta >= 0) {
+		cfg->type = SMOOTH_EURO;
+		return 1;
+	}
+	return 0;
+}
+
+static uint8_t channel(int32_t v) {
+	return (v + (1 << 15)) >> 16;
+}
+
+static void state_color(const struct smoother *sm, struct rgb_color *c) {
+	c->red = channel(sm->state[0]);
+	c->green = channel(sm->state[1]);
+	c->blue = channel(sm->state[2]);
+}
+
+static int same_color(const struct rgb_color *a, const struct rgb_color *b) {
+	return a->red == b->red && a->green == b->green && a->blue == b->blue;
+}
+
+/* weight of the new input (16 bit fraction) after dt seconds */
+static int32_t smooth_alpha(const struct smooth_config *cfg, double dt, double speed) {
+	double alpha = 1;
+	if (cfg->type == SMOOTH_EMA) {
+		alpha = 1 - exp(-dt * 1000 / cfg->tau);
+	} else if (cfg->type == SMOOTH_EURO) {
+		double tau = 1 / (2 * M_PI * (cfg->min_cutoff + cfg->beta * speed));
+		alpha = 1 / (1 + tau / dt);
+	}
+	return lround(alpha * 65536);
+}
+
+int smooth_color(const struct smooth_config *cfg, struct smoother *sm, uint64_t time_ns,
+		double speed, struct rgb_color *c) {
+	int32_t in[3] = {c->red << 16, c->green << 16, c->blue << 16};
+	int32_t alpha = 65536;
+	int i;
+
+	if (sm->started && time_ns > sm->time_ns)
+		alpha = smooth_alpha(cfg, (time_ns - sm->time_ns) / 1e9, speed);
+	else if (sm->started)
+		alpha = 0;
+	for (i = 0; i < 3; i++) {
+		int32_t step = (int64_t)(in[i] - sm->state[i]) * alpha >> 16;
+		/* a remainder too small to move on is taken at once */
+		if (!step && alpha)
+			sm->state[i] = in[i];
+		else
+			sm->state[i] += step;
+	}
+	sm->time_ns = time_ns;
+	sm->input = *c;
+	state_color(sm, c);
+
+	/* the first color, any change of at least step, and the final one
+	 * once a filter has caught up with the input
+	 */
+	if (!sm->started || !cfg->step ||
+			abs(c->red - sm->sent.red) >= cfg->step ||
+			abs(c->green - sm->sent.green) >= cfg->step ||
+			abs(c->blue - sm->sent.blue) >= cfg->step ||
+			(cfg->type && same_color(c, &sm->input) && !same_color(c, &sm->sent))) {
+		sm->started = 1;
+		sm->sent = *c;
+		return 1;
+	}
+	return 0;
+}
+
+int smooth_pending(const struct smoother *sm) {
+	struct rgb_color c;
+	if (!sm->started)
+		return 0;
+	state_color(sm, &c);
+	return !same_color(&c, &sm->input) || !same_color(&c, &sm->sent);
+}
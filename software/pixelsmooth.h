@@ -0,0 +1,66 @@
+/*
+ * pixelsmooth.h
+ *
+ * Temporal filter between sampling and output: colors jumping as the
+ * cursor crosses edges are smoothed, and changes too small to see are
+ * not passed on at all, saving updates of the outputs.
+ *
+ *   ema:MS         exponential moving average with a time constant of MS
+ *                  milliseconds
+ *   euro:HZ,BETA   one-euro filter: a moving average with a cutoff of HZ
+ *                  while the pointer rests, rising by BETA Hz per px/ms of
+ *                  pointer speed, so that it follows fast moves closely
+ *
+ * The state is kept in 16.16 fixed point per source.
+ */
+
+#ifndef __PIXELSMOOTH_H_INCLUDED__
+#define __PIXELSMOOTH_H_INCLUDED__
+
+#include "pixeltrack.h"
+
+enum smooth_type {
+	SMOOTH_NONE,
+	SMOOTH_EMA,
+	SMOOTH_EURO,
+};
+
+struct smooth_config {
+	enum smooth_type type;
+	/* SMOOTH_EMA: time constant in ms */
+	double tau;
+	/* SMOOTH_EURO: cutoff in Hz at rest and its growth with the speed */
+	double min_cutoff;
+	double beta;
+	/* changes below step on every channel are not passed on, 0 passes
+	 * every sample
+	 */
+	int step;
+};
+
+/* the filter of a source */
+struct smoother {
+	int started;
+	uint64_t time_ns;
+	int32_t state[3];
+	/* the newest color fed and the last one passed on */
+	struct rgb_color input;
+	struct rgb_color sent;
+};
+
+/* parse "ema:MS" or "euro:HZ,BETA" */
+int parse_smooth(const char *s, struct smooth_config *cfg);
+
+/* Feed the color sampled at time_ns with the pointer moving at speed
+ * px/ms; c is replaced by the filtered color. Returns 1 if that is to be
+ * passed on.
+ */
+int smooth_color(const struct smooth_config *cfg, struct smoother *sm, uint64_t time_ns,
+		double speed, struct rgb_color *c);
+
+/* 1 while the filtered color has not caught up with the input yet; the
+ * input (sm->input) has to be fed again until it has
+ */
+int smooth_pending(const struct smoother *sm);
+
+#endif /* __PIXELSMOOTH_H_INCLUDED__ */
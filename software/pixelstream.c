@@ -0,0 +1,52 @@
+/*
+ * pixelstream.c
+ *
+ * Encoding of the binary sample stream, see pixelstream.h
+ */
+
+#include <string.h>
+
+#include "pixelstream.h"
+
+static void put16(unsigned char *p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+	put16(p, v);
+	put16(p+2, v >> 16);
+}
+
+static void put64(unsigned char *p, uint64_t v) {
+	put32(p, v);
+	put32(p+4, v >> 32);
+}
+
+void pixel_stream_encode(unsigned char *buf, const struct sample *s) {
+	put64(buf, s->time_ns);
+	put32(buf+8, s->x);
+	put32(buf+12, s->y);
+	put32(buf+16, s->n_pixels);
+	put16(buf+20, s->source);
+	put16(buf+22, s->width);
+	put16(buf+24, s->height);
+	buf[26] = s->color.red;
+	buf[27] = s->color.green;
+	buf[28] = s->color.blue;
+	memset(buf+29, 0, 3);
+}
+
+int pixel_stream_header(FILE *f) {
+	unsigned char buf[PIXEL_STREAM_HEADER];
+	memcpy(buf, PIXEL_STREAM_MAGIC, 4);
+	put16(buf+4, PIXEL_STREAM_VERSION);
+	put16(buf+6, PIXEL_STREAM_RECORD);
+	return fwrite(buf, sizeof(buf), 1, f) == 1;
+}
+
+int pixel_stream_write(FILE *f, const struct sample *s) {
+	unsigned char buf[PIXEL_STREAM_RECORD];
+	pixel_stream_encode(buf, s);
+	return fwrite(buf, sizeof(buf), 1, f) == 1;
+}
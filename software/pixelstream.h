@@ -0,0 +1,45 @@
+/*
+ * pixelstream.h
+ *
+ * Binary stream format written by pixeltrack -b: an 8 byte header
+ * followed by one fixed size record per sample, all little-endian.
+ *
+ * header:
+ *   0  "PXST"
+ *   4  uint16 version
+ *   6  uint16 record size (PIXEL_STREAM_RECORD)
+ *
+ * record:
+ *   0  uint64 time_ns     CLOCK_MONOTONIC
+ *   8  int32  x           cursor position, or zone origin
+ *  12  int32  y
+ *  16  uint32 n_pixels    pixels averaged
+ *  20  uint16 source      0 is the cursor
+ *  22  uint16 width       the averaged window
+ *  24  uint16 height
+ *  26  uint8  red, green, blue
+ *  29  uint8  reserved[3]
+ *
+ * Later versions only append fields, so readers should skip records by
+ * the size given in the header.
+ */
+
+#ifndef __PIXELSTREAM_H_INCLUDED__
+#define __PIXELSTREAM_H_INCLUDED__
+
+#include <stdio.h>
+#include "pixeltrack.h"
+
+#define PIXEL_STREAM_MAGIC   "PXST"
+#define PIXEL_STREAM_VERSION 1
+#define PIXEL_STREAM_HEADER  8
+#define PIXEL_STREAM_RECORD  32
+
+/* encode a record into buf, which has room for PIXEL_STREAM_RECORD bytes */
+void pixel_stream_encode(unsigned char *buf, const struct sample *s);
+
+/* write the header or a record to a (buffered) stream */
+int pixel_stream_header(FILE *f);
+int pixel_stream_write(FILE *f, const struct sample *s);
+
+#endif /* __PIXELSTREAM_H_INCLUDED__ */
@@ -8,17 +8,32 @@
  */
 
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
 #include <sys/shm.h>
 #include <X11/extensions/XShm.h>
 #include <X11/extensions/XInput2.h>
+#include <X11/extensions/Xrender.h>
+#include <X11/extensions/Xrandr.h>
+#include <X11/extensions/Xfixes.h>
 #include <sys/ipc.h>
 
+#include "pixeltrack.h"
+#include "pixelring.h"
+#include "pixelstream.h"
+#include "pixelserver.h"
+#include "pixelfilter.h"
+#include "pixelsmooth.h"
 #ifdef USB_PIXEL
-#include <usb.h>
-#include "../firmware/requests.h"
-#include "../firmware/usbconfig.h"
+#include "usbpixel.h"
 #endif
 
 /* capture that many pixels _around_ the cursor position;
@@ -28,69 +43,544 @@
  */
 #define RADIUS 5
 
-/* ordered that way due to strange byte order in XImage */
-struct rgb_color {
-	uint8_t blue;
-	uint8_t green;
-	uint8_t red;
-	uint8_t alpha;
+/* adaptive radius: at this cursor speed (in px/ms) the radius is
+ * halved; while the pointers rest they are sampled again every
+ * ADAPT_INTERVAL ms with the radius growing by one each time
+ */
+#define ADAPT_SPEED 2
+#define ADAPT_INTERVAL 50
+
+/* zones are sampled that often (in ms) */
+#define ZONE_INTERVAL 40
+
+/* the text output prints the cursor color at most that often (in ms) */
+#define TEXT_INTERVAL 20
+
+/* filters still catching up with their input are fed it again that
+ * often (in ms)
+ */
+#define SMOOTH_INTERVAL 10
+
+/* master pointers tracked at the same time */
+#define MAX_POINTERS 16
+
+/* monitors (XRandR) told apart */
+#define MAX_MONITORS 16
+
+/* state of a tracked master pointer (see MPX) */
+struct pointer {
+	int deviceid;
+	int source;
+	int x;
+	int y;
+	int old_x;
+	int old_y;
+	int moved;
+	/* when old_x/old_y were sampled */
+	uint64_t sampled;
+	/* the window sampled last, allocated on first use */
+	struct window *win;
 };
 
-XShmSegmentInfo shminfo;
-XImage *img = NULL;
-struct {
+/* a shared memory image and the screen position it was captured at;
+ * the image may use less than the allocated capacity
+ */
+struct capture {
+	XShmSegmentInfo shminfo;
+	XImage *img;
+	int max_width;
+	int max_height;
+	struct {
+		int x;
+		int y;
+	} offset;
+	/* a pixel of the image covers 2^shift x 2^shift screen pixels */
+	int shift;
+};
+
+/* downscaling on the X server (-D): the area is halved once per level
+ * by XRender with a bilinear filter; sampling exactly between four
+ * pixels, that is the exact average of 2x2 pixels
+ */
+#define MAX_LEVELS 8
+
+struct scaler {
+	int levels;
+	Picture root;
+	Pixmap pix[MAX_LEVELS];
+	Picture pic[MAX_LEVELS];
+};
+
+/* an area of the screen, in screen coordinates */
+struct monitor {
 	int x;
 	int y;
-} img_offset;
+	int width;
+	int height;
+};
+
+/* what is tracked: sources[0] is the cursor, which follows pointers[0];
+ * the other sources are kept as long as a board or subscriber refers
+ * to them, released ones are dropped by the main loop
+ */
+struct source sources[MAX_SOURCES];
+int source_refs[MAX_SOURCES];
+int n_sources = 1;
+int sources_released = 0;
+struct pointer pointers[MAX_POINTERS];
+int n_pointers = 1;
+int n_zones = 0;
 
-void init_shm(Display *d, int radius) {
-	if (img != NULL) {
-		XShmDetach(d, &shminfo);
-		XDestroyImage(img);
-		shmdt(shminfo.shmaddr);
-		shmctl(shminfo.shmid, IPC_RMID, 0);
+/* radius of the area sampled around pointers; changes requested by
+ * subscribers or signals are applied by the main loop, subscribers
+ * cannot change a radius given with -r
+ */
+int radius = RADIUS;
+int radius_fixed = 0;
+int radius_request = -1;
+volatile sig_atomic_t radius_delta = 0;
+/* the radius currently sampled with; below radius only if adaptive */
+int sample_radius = RADIUS;
+
+/* adaptive radius (-a): CPU time budget per frame in ns, 0 for a fixed
+ * radius, and the CPU time per sampled pixel as measured so far
+ */
+long adapt_budget = 0;
+double adapt_cost = 0;
+
+/* whole screen mode (-F): interval of the frame clock in ms, 0 if off;
+ * the screen may be downscaled on the X server (-D), and checked
+ * against an exact capture (-C)
+ */
+int frame_interval = 0;
+int downscale = 0;
+int check_downscale = 0;
+struct scaler scaler;
+struct capture exact;
+
+/* geometry of the screen and its monitors, only queried again when
+ * XRandR reports a change; areas around pointers are kept within the
+ * monitor of the pointer
+ */
+struct monitor screen_geometry;
+struct monitor monitors[MAX_MONITORS];
+int n_monitors = 0;
+int rr_event_base = -1;
+int geometry_changed = 0;
+
+/* failed captures are reported by XShmGetImage() returning 0 instead
+ * of the default error handler exiting; a failed XShmAttach() (e.g. on
+ * a remote display) is noted for init_shm(), any other error still goes
+ * to the default handler
+ */
+int shm_major = -1;
+int shm_attach_failed = 0;
+/* MIT-SHM minor opcodes, from shmproto.h which needs the server headers */
+#define X_ShmAttach 1
+#define X_ShmGetImage 4
+int (*default_error_handler)(Display *, XErrorEvent *);
+
+/* weighting of the pixels sampled around pointers */
+enum kernel_type kernel = KERNEL_BOX;
+
+/* the text output also gives the OKLab coordinates (-O) */
+int text_oklab = 0;
+
+/* leave the cursor sprite out of the areas around pointers (-x): its
+ * image (XFixes) is kept as a mask with the hotspot at hot_x/hot_y and
+ * only fetched again when the cursor changes; other master pointers are
+ * assumed to show the same sprite. Whether captures contain the sprite
+ * depends on the server and cannot be told from here, so this is only
+ * done when asked for: without a sprite in the capture the mask leaves
+ * out the real pixels under it.
+ */
+int exclude_cursor = 0;
+int xfixes_event_base = -1;
+struct mask cursor;
+int hot_x = 0;
+int hot_y = 0;
+
+/* temporal filter (-f) and change suppression (-q) of every source;
+ * the newest sample of a source is fed again while its filter settles
+ */
+struct smooth_config smooth;
+struct smoother smoothers[MAX_SOURCES];
+struct sample smooth_samples[MAX_SOURCES];
+long smooth_next = 0;
+
+/* shared memory ring the samples are published in, if enabled */
+struct pixel_ring *ring = NULL;
+
+/* write binary records (see pixelstream.h) to stdout instead of text */
+int binary = 0;
+/* text output: the newest cursor sample not printed yet */
+int text_interval = TEXT_INTERVAL;
+int text_pending = 0;
+long text_next = 0;
+struct sample text_sample;
+
+#define VAL_MAX(x, y) ((x)>(y) ? (x) : (y))
+#define VAL_MIN(x, y) ((x)<(y) ? (x) : (y))
+#define VAL_BETWEEN(l, u, v) VAL_MIN( (VAL_MAX((l), (v))), (u))
+
+uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+long now_ms(void) {
+	return now_ns() / 1000000;
+}
+
+void free_shm(Display *d, struct capture *cap) {
+	if (cap->img == NULL)
+		return;
+	XShmDetach(d, &cap->shminfo);
+	cap->img->data = NULL;
+	XDestroyImage(cap->img);
+	cap->img = NULL;
+	shmdt(cap->shminfo.shmaddr);
+	shmctl(cap->shminfo.shmid, IPC_RMID, 0);
+}
+
+/* (re)allocate the capture for width x height pixels; returns 0 if it
+ * cannot be allocated or the X server cannot attach it, leaving
+ * cap->img NULL
+ */
+int init_shm(Display *d, struct capture *cap, int width, int height) {
+	free_shm(d, cap);
+
+	cap->img = XShmCreateImage( d, DefaultVisual(d, DefaultScreen(d)), DefaultDepth(d, DefaultScreen(d)),
+			ZPixmap, NULL, &cap->shminfo, width, height );
+	if (!cap->img)
+		return 0;
+	size_t imgsize = (size_t)cap->img->bytes_per_line * cap->img->height;
+	cap->shminfo.shmid = shmget( IPC_PRIVATE, imgsize, IPC_CREAT|0777 );
+	if (cap->shminfo.shmid < 0) {
+		XDestroyImage(cap->img);
+		cap->img = NULL;
+		return 0;
+	}
+	char* mem = (char*)shmat(cap->shminfo.shmid, 0, 0);
+	if (mem == (char *)-1) {
+		shmctl(cap->shminfo.shmid, IPC_RMID, 0);
+		XDestroyImage(cap->img);
+		cap->img = NULL;
+		return 0;
 	}
+	cap->shminfo.shmaddr = mem;
+	cap->img->data = mem;
+	cap->shminfo.readOnly = False;
+	cap->max_width = width;
+	cap->max_height = height;
+	shm_attach_failed = 0;
+	XShmAttach(d, &cap->shminfo);
+	/* the server reports a failed attach asynchronously */
+	XSync(d, False);
+	if (shm_attach_failed) {
+		cap->img->data = NULL;
+		XDestroyImage(cap->img);
+		cap->img = NULL;
+		shmdt(mem);
+		shmctl(cap->shminfo.shmid, IPC_RMID, 0);
+		return 0;
+	}
+	return 1;
+}
 
-	long width = (2*radius+1);
-	long height = (2*radius+1);
+/* use only width x height pixels of the capture, within its capacity;
+ * the X server lays out the rows of a smaller image without gaps
+ */
+void resize_capture(struct capture *cap, int width, int height) {
+	XImage *img = cap->img;
+	img->width = VAL_MIN(width, cap->max_width);
+	img->height = VAL_MIN(height, cap->max_height);
+	img->bytes_per_line = (img->width * img->bits_per_pixel + img->bitmap_pad - 1) /
+		img->bitmap_pad * (img->bitmap_pad / 8);
+}
 
-	img = XShmCreateImage( d, DefaultVisual(d, DefaultScreen(d)), DefaultDepth(d, DefaultScreen(d)),
-			ZPixmap, NULL, &shminfo, width, height );
-	int imgsize = img->bytes_per_line * img->height;
-	shminfo.shmid = shmget( IPC_PRIVATE, imgsize, IPC_CREAT|0777 );
-	char* mem = (char*)shmat(shminfo.shmid, 0, 0);
-	shminfo.shmaddr = mem;
-	img->data = mem;
-	shminfo.readOnly = False;
-	XShmAttach(d, &shminfo);
+/* radius requested by a subscriber; returns 0 if it was refused */
+int set_radius(int r) {
+	if (radius_fixed)
+		return 0;
+	radius_request = VAL_BETWEEN(0, MAX_RADIUS, r);
+	return 1;
+}
+
+/* SIGUSR1 grows the radius by one, SIGUSR2 shrinks it */
+void radius_signal(int sig) {
+	radius_delta += sig == SIGUSR1 ? 1 : -1;
+}
+
+/* sample with radius r, reusing the allocated captures */
+void use_radius(struct capture *single, struct capture *batch, int r) {
+	if (r == sample_radius)
+		return;
+	sample_radius = r;
+	resize_capture(single, 2*r+1, 2*r+1);
+	resize_capture(batch, 2*(2*r+1), 2*(2*r+1));
+}
+
+/* apply a requested radius change; an adaptive radius stays below it */
+void update_radius(struct capture *single, struct capture *batch) {
+	int r = radius_request >= 0 ? radius_request : radius;
+	r = VAL_BETWEEN(0, MAX_RADIUS, r + radius_delta);
+	radius_request = -1;
+	radius_delta = 0;
+	if (r == radius)
+		return;
+	radius = r;
+	if (!adapt_budget || sample_radius > radius)
+		use_radius(single, batch, radius);
+	fprintf(stderr, "Radius %d\n", radius);
+}
+
+/* CPU time used by this thread, as accounted by the kernel */
+uint64_t cpu_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* speed of a pointer since it was sampled last in px/ms */
+double pointer_speed(const struct pointer *p, uint64_t now) {
+	if (p->old_x < 0 || !p->sampled || now <= p->sampled)
+		return 0;
+	return hypot(p->x - p->old_x, p->y - p->old_y) * 1e6 / (now - p->sampled);
+}
+
+/* radius for the next frame: smaller the faster the pointers move, small
+ * enough for the budget and growing by at most one per frame
+ */
+int adapt_radius(struct pointer *ptrs, int n_ptrs) {
+	uint64_t now = now_ns();
+	double speed = 0;
+	int i, r, n_moved = 0;
+
+	for (i = 0; i < n_ptrs; i++) {
+		struct pointer *p = &ptrs[i];
+		if (!p->moved)
+			continue;
+		n_moved++;
+		speed = VAL_MAX(speed, pointer_speed(p, now));
+	}
+	r = radius * ADAPT_SPEED / (ADAPT_SPEED + speed);
+	if (adapt_cost > 0 && n_moved) {
+		double pixels = adapt_budget / (adapt_cost * n_moved);
+		r = VAL_MIN(r, (int)((sqrt(pixels) - 1) / 2));
+	}
+	r = VAL_MIN(r, sample_radius + 1);
+	return VAL_BETWEEN(0, radius, r);
+}
+
+/* account the CPU time a frame of n samples took */
+void adapt_account(uint64_t cpu, int n) {
+	double cost;
+	if (!n)
+		return;
+	cost = (double)cpu / (n * (2*sample_radius+1) * (2*sample_radius+1));
+	adapt_cost = adapt_cost > 0 ? 0.8 * adapt_cost + 0.2 * cost : cost;
 }
 
 void init_xinput(Display *d) {
 	XIEventMask eventmask;
 	unsigned char mask[1] = {0};
-	eventmask.deviceid = XIAllDevices;
+	/* master devices only: one stream of events per cursor */
+	eventmask.deviceid = XIAllMasterDevices;
 	eventmask.mask_len = sizeof(mask);
 	eventmask.mask = mask;
 	XISetMask(mask, XI_Motion);
 	XISelectEvents(d, RootWindow(d, DefaultScreen (d)), &eventmask, 1);
 }
 
-#define VAL_MAX(x, y) ((x)>(y) ? (x) : (y))
-#define VAL_MIN(x, y) ((x)<(y) ? (x) : (y))
-#define VAL_BETWEEN(l, u, v) VAL_MIN( (VAL_MAX((l), (v))), (u))
-int refresh_image(Display *d, int x, int y, int radius) {
+int x_error(Display *d, XErrorEvent *e) {
+	if (e->request_code == shm_major && e->minor_code == X_ShmGetImage)
+		return 0;
+	if (e->request_code == shm_major && e->minor_code == X_ShmAttach) {
+		shm_attach_failed = 1;
+		return 0;
+	}
+	return default_error_handler(d, e);
+}
+
+/* query the size of the screen and its monitors */
+void update_geometry(Display *d) {
+	int screen = DefaultScreen(d);
+	struct monitor *s = &screen_geometry;
+	int i, n = 0;
+
+	s->x = s->y = 0;
+	s->width = DisplayWidth(d, screen);
+	s->height = DisplayHeight(d, screen);
+	n_monitors = 0;
+	if (rr_event_base >= 0) {
+		XRRMonitorInfo *m = XRRGetMonitors(d, RootWindow(d, screen), True, &n);
+		for (i = 0; m && i < n && n_monitors < MAX_MONITORS; i++) {
+			/* only the part on the screen */
+			struct monitor *o = &monitors[n_monitors];
+			o->x = VAL_MAX(m[i].x, 0);
+			o->y = VAL_MAX(m[i].y, 0);
+			o->width = VAL_MIN(m[i].x + m[i].width, s->width) - o->x;
+			o->height = VAL_MIN(m[i].y + m[i].height, s->height) - o->y;
+			if (o->width > 0 && o->height > 0)
+				n_monitors++;
+		}
+		if (m)
+			XRRFreeMonitors(m);
+	}
+	if (!n_monitors)
+		monitors[n_monitors++] = *s;
+}
+
+void init_geometry(Display *d) {
+	int event, error;
+
+	if (XQueryExtension(d, "MIT-SHM", &shm_major, &event, &error))
+		default_error_handler = XSetErrorHandler(x_error);
+	if (XRRQueryExtension(d, &rr_event_base, &error))
+		XRRSelectInput(d, RootWindow(d, DefaultScreen(d)), RRScreenChangeNotifyMask);
+	else
+		rr_event_base = -1;
+	update_geometry(d);
+}
+
+/* the monitor showing x/y; outside of all monitors the whole screen */
+const struct monitor *monitor_at(int x, int y) {
+	int i;
+	for (i = 0; i < n_monitors; i++) {
+		const struct monitor *m = &monitors[i];
+		if (x >= m->x && x < m->x + m->width && y >= m->y && y < m->y + m->height)
+			return m;
+	}
+	return &screen_geometry;
+}
+
+/* mask the opaque and translucent pixels of the current cursor image */
+void update_cursor(Display *d) {
+	XFixesCursorImage *img = XFixesGetCursorImage(d);
+	int x, y;
+
+	cursor.width = cursor.height = 0;
+	if (!img)
+		return;
+	/* larger sprites are masked in part */
+	cursor.width = VAL_MIN(img->width, MASK_SIZE);
+	cursor.height = VAL_MIN(img->height, MASK_SIZE);
+	for (y = 0; y < cursor.height; y++) {
+		for (x = 0; x < cursor.width; x++)
+			cursor.bits[y][x] = (img->pixels[y*img->width + x] >> 24) != 0;
+	}
+	hot_x = img->xhot;
+	hot_y = img->yhot;
+	XFree(img);
+}
+
+int init_cursor(Display *d) {
+	int error;
+
+	if (!XFixesQueryExtension(d, &xfixes_event_base, &error)) {
+		xfixes_event_base = -1;
+		return 0;
+	}
+	XFixesSelectCursorInput(d, RootWindow(d, DefaultScreen(d)), XFixesDisplayCursorNotifyMask);
+	update_cursor(d);
+	return 1;
+}
+
+/* the mask of the cursor sprite, NULL if it is not left out */
+const struct mask *cursor_mask(void) {
+	return exclude_cursor && cursor.width ? &cursor : NULL;
+}
+
+/* capture the image with its upper left corner as close to x/y as the
+ * borders of the area (NULL for the whole screen) allow; returns 0 if
+ * the capture failed
+ */
+int refresh_area(Display *d, struct capture *cap, const struct monitor *area, int x, int y) {
+	const struct monitor *s = &screen_geometry;
+	if (!area)
+		area = s;
+	x = VAL_BETWEEN(area->x, area->x + area->width - cap->img->width, x);
+	y = VAL_BETWEEN(area->y, area->y + area->height - cap->img->height, y);
+	/* an image larger than the area still has to be on the screen */
+	cap->offset.x = VAL_BETWEEN(0, s->width - cap->img->width, x);
+	cap->offset.y = VAL_BETWEEN(0, s->height - cap->img->height, y);
+
+	return XShmGetImage(d, RootWindow(d, DefaultScreen(d)), cap->img, cap->offset.x, cap->offset.y, AllPlanes);
+}
+
+int refresh_image(Display *d, struct capture *cap, int x, int y, int radius) {
 	/* if we are near the border, we capture more than just the area around the cursor */
-	int w = DisplayWidth(d, DefaultScreen(d));
-	int h = DisplayHeight(d, DefaultScreen(d));
-	img_offset.x = VAL_BETWEEN(radius, w-1-2*radius, x);
-	img_offset.y = VAL_BETWEEN(radius, h-1-2*radius, y);
+	return refresh_area(d, cap, monitor_at(x, y), x-radius, y-radius);
+}
+
+/* prepare halving an area of width x height pixels levels times */
+int init_scaler(Display *d, struct scaler *s, int width, int height, int levels) {
+	int screen = DefaultScreen(d);
+	XRenderPictFormat *fmt;
+	XRenderPictureAttributes pa;
+	int event, error, i;
+
+	if (!XRenderQueryExtension(d, &event, &error) ||
+			!(fmt = XRenderFindVisualFormat(d, DefaultVisual(d, screen))))
+		return 0;
+	pa.subwindow_mode = IncludeInferiors;
+	s->root = XRenderCreatePicture(d, RootWindow(d, screen), fmt, CPSubwindowMode, &pa);
+	s->levels = VAL_MIN(levels, MAX_LEVELS);
+	for (i = 0; i < s->levels; i++) {
+		width >>= 1;
+		height >>= 1;
+		s->pix[i] = XCreatePixmap(d, RootWindow(d, screen), VAL_MAX(width, 1), VAL_MAX(height, 1),
+				DefaultDepth(d, screen));
+		s->pic[i] = XRenderCreatePicture(d, s->pix[i], fmt, 0, NULL);
+		XRenderSetPictureFilter(d, i ? s->pic[i-1] : s->root, FilterBilinear, NULL, 0);
+	}
+	return 1;
+}
+
+void free_scaler(Display *d, struct scaler *s) {
+	int i;
+	for (i = 0; i < s->levels; i++) {
+		XRenderFreePicture(d, s->pic[i]);
+		XFreePixmap(d, s->pix[i]);
+	}
+	if (s->levels)
+		XRenderFreePicture(d, s->root);
+	memset(s, 0, sizeof(*s));
+}
+
+/* capture the area at x/y downscaled into cap, whose image is the area
+ * shrunk by the levels of the scaler
+ */
+int refresh_scaled(Display *d, struct scaler *s, struct capture *cap, int x, int y) {
+	XTransform halve = {{
+		{XDoubleToFixed(2), 0, XDoubleToFixed(x)},
+		{0, XDoubleToFixed(2), XDoubleToFixed(y)},
+		{0, 0, XDoubleToFixed(1)}}};
+	int i, w = cap->img->width << s->levels, h = cap->img->height << s->levels;
 
-	int ret =  XShmGetImage(d, RootWindow(d, DefaultScreen (d)), img, img_offset.x, img_offset.y, AllPlanes);
-	return ret;
+	for (i = 0; i < s->levels; i++) {
+		Picture src = i ? s->pic[i-1] : s->root;
+		w >>= 1;
+		h >>= 1;
+		XRenderSetPictureTransform(d, src, &halve);
+		XRenderComposite(d, PictOpSrc, src, None, s->pic[i], 0, 0, 0, 0, 0, 0, w, h);
+		/* only the first level is offset */
+		halve.matrix[0][2] = halve.matrix[1][2] = 0;
+	}
+	cap->offset.x = x;
+	cap->offset.y = y;
+	cap->shift = s->levels;
+	return XShmGetImage(d, s->pix[s->levels-1], cap->img, 0, 0, AllPlanes);
 }
 
-void get_pixel_color(Display *d, int x, int y, struct rgb_color *c, int radius) {
 #if USE_XQUERYCOLOR
+/* average color of the captured pixels within x0/y0 - x1/y1 (inclusive),
+ * returns the number of pixels averaged
+ */
+int get_area_color(Display *d, struct capture *cap, int x0, int y0, int x1, int y1, struct rgb_color *c) {
+	XImage *img = cap->img;
 	/* Cache color lookups */
 #define CACHE_SIZE 16384
 	static unsigned long pixels[CACHE_SIZE] = {0};
@@ -98,10 +588,6 @@ void get_pixel_color(Display *d, int x, int y, struct rgb_color *c, int radius)
 	static uint8_t cached[CACHE_SIZE] = {0};
 
 	XColor xc;
-#else
-	/* we blindly assume that we have an array of rgb structs */
-	struct rgb_color *pic = (struct rgb_color *)img->data;
-#endif
 	/* calculate average color */
 	long ix, iy;
 	unsigned long r = 0;
@@ -109,10 +595,9 @@ void get_pixel_color(Display *d, int x, int y, struct rgb_color *c, int radius)
 	unsigned long b = 0;
 	int n_pixels = 0;
 	for (ix=0; ix < img->width; ix++) {
-		if (ix+img_offset.x < x-radius || ix+img_offset.x > x+radius) continue;
+		if (ix+cap->offset.x < x0 || ix+cap->offset.x > x1) continue;
 		for (iy=0; iy < img->height; iy++) {
-			if (iy+img_offset.y < y-radius || iy+img_offset.y > y+radius) continue;
-#if USE_XQUERYCOLOR
+			if (iy+cap->offset.y < y0 || iy+cap->offset.y > y1) continue;
 			unsigned long p = XGetPixel(img, ix, iy);
 			if (cached[p%CACHE_SIZE] && pixels[p%CACHE_SIZE] == p) {
 				xc = colors[p%CACHE_SIZE];
@@ -126,112 +611,855 @@ void get_pixel_color(Display *d, int x, int y, struct rgb_color *c, int radius)
 			r += xc.red>>8;
 			g += xc.green>>8;
 			b += xc.blue>>8;
-#else
-			struct rgb_color *pixel = &pic[ix+iy*img->width];
-			r += pixel->red;
-			g += pixel->green;
-			b += pixel->blue;
-#endif
 			n_pixels++;
 		}
 	}
 	c->red = (r/n_pixels);
 	c->green = (g/n_pixels);
 	c->blue = (b/n_pixels);
+	return n_pixels;
+}
+
+/* only the box kernel is available with color lookups */
+int get_pixel_color(Display *d, struct capture *cap, int x, int y, struct rgb_color *c, int radius) {
+	return get_area_color(d, cap, x-radius, y-radius, x+radius, y+radius, c);
+}
+
+int get_window_color(Display *d, struct capture *cap, struct pointer *p, struct rgb_color *c, int radius) {
+	return get_pixel_color(d, cap, p->x, p->y, c, radius);
+}
+
+int get_strip_color(Display *d, struct capture *strip, struct pointer *p, struct rgb_color *c, int radius) {
+	return -1;
+}
+#else
+/* average the captured pixels within x0/y0 - x1/y1 (screen coordinates,
+ * inclusive) weighted by a kernel centered at cx/cy, leaving out the
+ * pixels of the mask at mx/my if any; a downscaled capture is not masked
+ */
+int filter_capture(struct capture *cap, int x0, int y0, int x1, int y1,
+		enum kernel_type k, int cx, int cy, int radius,
+		const struct mask *m, int mx, int my, struct rgb_color *c) {
+	XImage *img = cap->img;
+	/* we blindly assume that we have an array of rgb structs */
+	struct rgb_color *pic = (struct rgb_color *)img->data;
+	int ox = cap->offset.x, oy = cap->offset.y, s = cap->shift;
+	return filter_area_masked(pic, img->bytes_per_line / sizeof(*pic),
+			VAL_MAX((x0-ox) >> s, 0), VAL_MAX((y0-oy) >> s, 0),
+			VAL_MIN((x1-ox) >> s, img->width-1), VAL_MIN((y1-oy) >> s, img->height-1),
+			k, (cx-ox) >> s, (cy-oy) >> s, radius >> s, s ? NULL : m, mx-ox, my-oy, c);
+}
+
+/* average color of the captured pixels within x0/y0 - x1/y1 (inclusive),
+ * returns the number of pixels averaged
+ */
+int get_area_color(Display *d, struct capture *cap, int x0, int y0, int x1, int y1, struct rgb_color *c) {
+	return filter_capture(cap, x0, y0, x1, y1, KERNEL_BOX, 0, 0, 0, NULL, 0, 0, c);
+}
+
+/* the area around x/y within its monitor, without the cursor sprite */
+int get_pixel_color(Display *d, struct capture *cap, int x, int y, struct rgb_color *c, int radius) {
+	const struct monitor *m = monitor_at(x, y);
+	return filter_capture(cap, VAL_MAX(x-radius, m->x), VAL_MAX(y-radius, m->y),
+			VAL_MIN(x+radius, m->x + m->width - 1), VAL_MIN(y+radius, m->y + m->height - 1),
+			kernel, x, y, radius, cursor_mask(), x-hot_x, y-hot_y, c);
+}
+
+/* color of the updated window of a pointer without the cursor sprite,
+ * returns the number of pixels left out
+ */
+int window_color(struct pointer *p, struct rgb_color *c) {
+	const struct mask *m = cursor_mask();
+	int masked;
+
+	if (m)
+		window_mask(p->win, m, p->x-hot_x, p->y-hot_y);
+	masked = p->win->masked;
+	if (p->win->histogram)
+		window_dominant(p->win, c);
+	else
+		window_mean(p->win, c);
+	if (m)
+		window_unmask(p->win, m, p->x-hot_x, p->y-hot_y);
+	return masked;
+}
+
+/* mean or dominant color around a pointer, counted incrementally in a
+ * window following it
+ */
+int get_window_color(Display *d, struct capture *cap, struct pointer *p, struct rgb_color *c, int radius) {
+	XImage *img = cap->img;
+	struct rgb_color *pic = (struct rgb_color *)img->data;
+	const struct monitor *m = monitor_at(p->x, p->y);
+	int ox = cap->offset.x, oy = cap->offset.y;
+	int n;
+
+	if (!p->win && !(p->win = calloc(1, sizeof(*p->win))))
+		return get_pixel_color(d, cap, p->x, p->y, c, radius);
+	p->win->histogram = kernel == KERNEL_DOMINANT;
+	n = window_update(p->win, pic, img->bytes_per_line / sizeof(*pic), ox, oy,
+			VAL_MAX(p->x-radius, VAL_MAX(ox, m->x)), VAL_MAX(p->y-radius, VAL_MAX(oy, m->y)),
+			VAL_MIN(p->x+radius, VAL_MIN(ox+img->width, m->x + m->width) - 1),
+			VAL_MIN(p->y+radius, VAL_MIN(oy+img->height, m->y + m->height) - 1));
+	if (!n)
+		return 0;
+	return n - window_color(p, c);
+}
+
+/* Like get_window_color(), but only the strips entering the window of
+ * the pointer are captured, one XShmGetImage per strip into the strip
+ * capture. Returns -1 if the window has to be captured as a whole.
+ */
+int get_strip_color(Display *d, struct capture *strip, struct pointer *p, struct rgb_color *c, int radius) {
+	const struct monitor *m = monitor_at(p->x, p->y);
+	struct rect r, enter[2];
+	int i, n;
+
+	if (!p->win)
+		return -1;
+	r.x0 = VAL_MAX(p->x-radius, m->x);
+	r.y0 = VAL_MAX(p->y-radius, m->y);
+	r.x1 = VAL_MIN(p->x+radius, m->x + m->width - 1);
+	r.y1 = VAL_MIN(p->y+radius, m->y + m->height - 1);
+	if ((n = window_slide(p->win, &r, enter)) < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		XImage *img = strip->img;
+		resize_capture(strip, enter[i].x1-enter[i].x0+1, enter[i].y1-enter[i].y0+1);
+		if (!refresh_area(d, strip, m, enter[i].x0, enter[i].y0)) {
+			/* part of the window is missing, count it anew */
+			p->win->valid = 0;
+			return -1;
+		}
+		window_add(p->win, (struct rgb_color *)img->data, img->bytes_per_line / sizeof(struct rgb_color),
+				strip->offset.x, strip->offset.y, &enter[i]);
+	}
+	return (r.x1-r.x0+1) * (r.y1-r.y0+1) - window_color(p, c);
 }
+#endif
 
-void wait_for_movement(Display *d, int *x, int *y) {
+/* Wait up to timeout ms (-1 for ever) for pointers to move, handling
+ * USB events in the meantime; all queued motion events are consumed so
+ * that moved pointers can be sampled together. Returns the number of
+ * pointers that changed their position.
+ */
+int wait_for_movement(Display *d, struct pointer *ptrs, int n_ptrs, int timeout) {
 	XEvent ev;
 	XGenericEventCookie *cookie = &ev.xcookie;
-	XNextEvent(d, &ev);
-	if (XGetEventData(d, cookie)) {
+	int i, moved = 0;
+
+	struct pollfd fds[32];
+	int n = 1;
+	/* USB completions and subscribers are handled on every pass, even
+	 * while motion events keep queuing up; then without waiting
+	 */
+	if (XPending(d))
+		timeout = 0;
+	fds[0].fd = ConnectionNumber(d);
+	fds[0].events = POLLIN;
+#ifdef USB_PIXEL
+	int usb_wait = usb_timeout();
+	n += usb_pollfds(fds+n, 32-n);
+	if (usb_wait >= 0 && (timeout < 0 || usb_wait < timeout))
+		timeout = usb_wait;
+#endif
+	n += server_pollfds(fds+n, 32-n);
+	poll(fds, n, timeout);
+#ifdef USB_PIXEL
+	usb_poll();
+#endif
+	server_poll();
+	while (XPending(d)) {
+		XNextEvent(d, &ev);
+		if (rr_event_base >= 0 && ev.type == rr_event_base + RRScreenChangeNotify) {
+			XRRUpdateConfiguration(&ev);
+			update_geometry(d);
+			geometry_changed = 1;
+			continue;
+		}
+		if (xfixes_event_base >= 0 && ev.type == xfixes_event_base + XFixesCursorNotify) {
+			update_cursor(d);
+			continue;
+		}
+		if (!XGetEventData(d, cookie))
+			continue;
 		XIDeviceEvent *xd;
 		switch(cookie->evtype) {
 			case XI_Motion:
 				xd = cookie->data;
-				*x = xd->root_x;
-				*y = xd->root_y;
+				for (i = 0; i < n_ptrs; i++) {
+					if (ptrs[i].deviceid != xd->deviceid)
+						continue;
+					ptrs[i].x = xd->root_x;
+					ptrs[i].y = xd->root_y;
+					ptrs[i].moved = ptrs[i].x != ptrs[i].old_x || ptrs[i].y != ptrs[i].old_y;
+				}
 				break;
 		}
 		XFreeEventData(d, cookie);
 	}
+	for (i = 0; i < n_ptrs; i++)
+		moved += ptrs[i].moved;
+	return moved;
+}
+
+/* print the pending cursor sample once the text interval has passed */
+void flush_text(void) {
+	struct sample *s = &text_sample;
+	if (!text_pending || now_ms() < text_next)
+		return;
+	if (text_oklab) {
+		double lab[3];
+		oklab(&s->color, lab);
+		printf("%d/%d\t(%d/%d/%d)\t[%.3f/%.3f/%.3f]\n", s->x, s->y,
+				s->color.red, s->color.green, s->color.blue, lab[0], lab[1], lab[2]);
+	} else {
+		printf("%d/%d\t(%d/%d/%d)\n", s->x, s->y, s->color.red, s->color.green, s->color.blue);
+	}
+	text_pending = 0;
+	text_next = now_ms() + text_interval;
+}
+
+/* hand a sample to all outputs */
+void put_color(struct sample *s) {
+	server_send(s);
+	if (binary) {
+		pixel_stream_write(stdout, s);
+	} else if (s->source == 0) {
+		text_sample = *s;
+		text_pending = 1;
+		flush_text();
+	}
+#ifdef USB_PIXEL
+	usb_send(s->source, &s->color);
+#endif
+	if (ring) {
+		struct pixel_sample ps = {
+			.time_ns = s->time_ns,
+			.x = s->x,
+			.y = s->y,
+			.source = s->source,
+			.red = s->color.red,
+			.green = s->color.green,
+			.blue = s->color.blue,
+			.width = s->width,
+			.height = s->height,
+			.n_pixels = s->n_pixels,
+		};
+		pixel_ring_publish(ring, &ps);
+	}
+}
+
+/* pass a sample through the filter of its source, the pointer moving
+ * at speed px/ms; returns 1 if it is to be put out
+ */
+int smooth_sample(struct sample *s, double speed) {
+	if ((!smooth.type && !smooth.step) || s->source >= MAX_SOURCES)
+		return 1;
+	smooth_samples[s->source] = *s;
+	return smooth_color(&smooth, &smoothers[s->source], s->time_ns, speed, &s->color);
 }
 
-uint8_t open_usb(usb_dev_handle **handle) {
-	uint16_t vid = 0x16c0;
-	uint16_t pid = 0x05df;
-	struct usb_bus *bus;
-	struct usb_device *dev;
-	usb_dev_handle *target = NULL;
+/* number of filters that have not caught up with their input yet */
+int settling(void) {
+	int i, n = 0;
+	for (i = 0; i < n_sources; i++)
+		n += smooth_pending(&smoothers[i]);
+	return n;
+}
 
-	usb_init();
-	usb_find_busses();
-	usb_find_devices();
-	for (bus=usb_get_busses(); bus; bus=bus->next) {
-		for (dev=bus->devices; dev; dev=dev->next) {
-			if (dev->descriptor.idVendor == vid && dev->descriptor.idProduct == pid) {
-				target = usb_open(dev);
+/* feed these filters their newest sample again */
+void settle_samples(void) {
+	int i;
+	for (i = 0; i < n_sources; i++) {
+		struct sample s = smooth_samples[i];
+		if (!smooth_pending(&smoothers[i]))
+			continue;
+		s.time_ns = now_ns();
+		if (smooth_color(&smooth, &smoothers[i], s.time_ns, 0, &s.color))
+			put_color(&s);
+	}
+}
+
+/* hand the sample of a pointer to all outputs and remember where it
+ * was taken
+ */
+void put_pointer(struct pointer *p, struct sample *s) {
+	s->time_ns = now_ns();
+	s->source = p->source;
+	s->x = p->x;
+	s->y = p->y;
+	if (smooth_sample(s, pointer_speed(p, s->time_ns)))
+		put_color(s);
+	p->old_x = p->x;
+	p->old_y = p->y;
+	p->sampled = s->time_ns;
+	p->moved = 0;
+}
+
+/* Sample the area around every pointer that moved. Pointers with
+ * overlapping windows are captured with a single grab into the batch
+ * image, as long as their combined area fits into it. Returns the
+ * number of samples taken.
+ */
+int sample_pointers(Display *d, struct pointer *ptrs, int n_ptrs,
+		struct capture *single, struct capture *batch, struct capture *strip, int radius) {
+	struct pointer *group[MAX_POINTERS];
+	struct sample sample;
+	int i, j, k, n_group, n = 0;
+	/* weighted kernels move with the pointer, they cannot be slid */
+	int slide = kernel == KERNEL_BOX || kernel == KERNEL_DOMINANT;
+
+	sample.color.alpha = 255;
+	sample.width = sample.height = 2*radius+1;
+	for (i = 0; i < n_ptrs; i++) {
+		struct pointer *p = &ptrs[i];
+		if (!p->moved)
+			continue;
+		if (slide && (sample.n_pixels = get_strip_color(d, strip, p, &sample.color, radius)) >= 0) {
+			put_pointer(p, &sample);
+			n++;
+			continue;
+		}
+		const struct monitor *m = monitor_at(p->x, p->y);
+		int x0 = p->x-radius, y0 = p->y-radius;
+		int x1 = p->x+radius, y1 = p->y+radius;
+		n_group = 0;
+		group[n_group++] = p;
+		for (j = i+1; j < n_ptrs; j++) {
+			struct pointer *q = &ptrs[j];
+			if (!q->moved || q->x-radius > x1 || q->x+radius < x0 ||
+					q->y-radius > y1 || q->y+radius < y0 || monitor_at(q->x, q->y) != m)
+				continue;
+			int nx0 = VAL_MIN(x0, q->x-radius), ny0 = VAL_MIN(y0, q->y-radius);
+			int nx1 = VAL_MAX(x1, q->x+radius), ny1 = VAL_MAX(y1, q->y+radius);
+			if (nx1-nx0 >= batch->img->width || ny1-ny0 >= batch->img->height)
+				continue;
+			x0 = nx0; y0 = ny0; x1 = nx1; y1 = ny1;
+			q->moved = 0;
+			group[n_group++] = q;
+		}
+
+		struct capture *cap = single;
+		int ok;
+		if (n_group > 1) {
+			cap = batch;
+			ok = refresh_area(d, batch, m, x0, y0);
+		} else {
+			ok = refresh_image(d, single, p->x, p->y, radius);
+		}
+		for (k = 0; k < n_group; k++) {
+			if (!ok) {
+				/* no sample; they are sampled again once they move */
+				group[k]->moved = 0;
+				continue;
 			}
+			struct pointer *g = group[k];
+			if (slide)
+				sample.n_pixels = get_window_color(d, cap, g, &sample.color, radius);
+			else
+				sample.n_pixels = get_pixel_color(d, cap, g->x, g->y, &sample.color, radius);
+			put_pointer(g, &sample);
+			n++;
 		}
 	}
-	//return (usbOpenDevice(&handle, vid, vendor, pid, product, NULL, NULL, NULL) != 0);
-	//return (usbOpenDevice(&handle, 0x16c0, NULL, 0x05df, NULL) != 0);
-	if (target != NULL) {
-		*handle = target;
+	return n;
+}
+
+/* sample zone i from a capture containing it */
+void put_zone(Display *d, struct capture *cap, int i) {
+	struct source *src = &sources[i];
+	struct sample sample;
+	sample.time_ns = now_ns();
+	sample.source = i;
+	sample.x = src->x;
+	sample.y = src->y;
+	sample.width = src->width;
+	sample.height = src->height;
+	sample.color.alpha = 255;
+	sample.n_pixels = get_area_color(d, cap, src->x, src->y,
+			src->x + src->width - 1, src->y + src->height - 1, &sample.color);
+	if (smooth_sample(&sample, 0))
+		put_color(&sample);
+}
+
+static int max_deviation(const struct rgb_color *a, const struct rgb_color *b) {
+	return VAL_MAX(abs(a->red - b->red), VAL_MAX(abs(a->green - b->green), abs(a->blue - b->blue)));
+}
+
+/* -C: compare the colors of the downscaled screen against the exact
+ * average of a full capture and report the largest deviation
+ */
+void check_scaled(Display *d, struct capture *scaled, struct pointer *ptrs, int n_ptrs, int radius) {
+	struct rgb_color a, b;
+	int i, dev = 0;
+
+	if (!refresh_area(d, &exact, NULL, 0, 0))
+		return;
+	for (i = 0; i < n_ptrs; i++) {
+		if (!ptrs[i].moved)
+			continue;
+		get_pixel_color(d, scaled, ptrs[i].x, ptrs[i].y, &a, radius);
+		get_pixel_color(d, &exact, ptrs[i].x, ptrs[i].y, &b, radius);
+		dev = VAL_MAX(dev, max_deviation(&a, &b));
+	}
+	for (i = 1; i < n_sources; i++) {
+		struct source *src = &sources[i];
+		if (src->type != SOURCE_ZONE)
+			continue;
+		get_area_color(d, scaled, src->x, src->y, src->x + src->width - 1, src->y + src->height - 1, &a);
+		get_area_color(d, &exact, src->x, src->y, src->x + src->width - 1, src->y + src->height - 1, &b);
+		dev = VAL_MAX(dev, max_deviation(&a, &b));
+	}
+	fprintf(stderr, "Downscaled colors deviate by up to %d\n", dev);
+}
+
+/* Whole screen mode: capture the screen once and sample every pointer
+ * that moved and every zone from it. Returns the number of pointers
+ * sampled.
+ */
+int sample_frame(Display *d, struct capture *screen, struct pointer *ptrs, int n_ptrs, int radius) {
+	struct sample sample;
+	int i, ok, n = 0;
+	/* a downscaled screen has no pixels to slide a window over */
+	int slide = (kernel == KERNEL_BOX || kernel == KERNEL_DOMINANT) && !scaler.levels;
+
+	if (scaler.levels)
+		ok = refresh_scaled(d, &scaler, screen, 0, 0);
+	else
+		ok = refresh_area(d, screen, NULL, 0, 0);
+	if (!ok)
+		return 0;
+	if (exact.img)
+		check_scaled(d, screen, ptrs, n_ptrs, radius);
+	sample.color.alpha = 255;
+	sample.width = sample.height = 2*radius+1;
+	for (i = 0; i < n_ptrs; i++) {
+		struct pointer *p = &ptrs[i];
+		if (!p->moved)
+			continue;
+		if (slide)
+			sample.n_pixels = get_window_color(d, screen, p, &sample.color, radius);
+		else
+			sample.n_pixels = get_pixel_color(d, screen, p->x, p->y, &sample.color, radius);
+		put_pointer(p, &sample);
+		n++;
+	}
+	for (i = 1; i < n_sources; i++) {
+		if (sources[i].type == SOURCE_ZONE)
+			put_zone(d, screen, i);
+	}
+	return n;
+}
+
+/* allocate the captures of the whole screen mode for the current size
+ * of the screen; returns 0 if the screen cannot be captured
+ */
+int init_frame(Display *d, struct capture *screen) {
+	int w = screen_geometry.width, h = screen_geometry.height;
+	free_scaler(d, &scaler);
+	if (downscale && !init_scaler(d, &scaler, w, h, downscale)) {
+		fprintf(stderr, "XRender not available, capturing the screen unscaled\n");
+		scaler.levels = 0;
+	}
+	if (!init_shm(d, screen, VAL_MAX(w >> scaler.levels, 1), VAL_MAX(h >> scaler.levels, 1)))
+		return 0;
+	if (scaler.levels && check_downscale && !init_shm(d, &exact, w, h))
+		fprintf(stderr, "Unable to capture the screen exactly, not comparing\n");
+	return 1;
+}
+
+/* clip a zone to the screen; returns 0 if it is larger than the screen
+ * or lies outside of it
+ */
+int clip_zone(struct source *src) {
+	int w = screen_geometry.width, h = screen_geometry.height;
+	if (src->width > w || src->height > h)
+		return 0;
+	if (src->x < 0) {
+		src->width += src->x;
+		src->x = 0;
+	}
+	if (src->y < 0) {
+		src->height += src->y;
+		src->y = 0;
+	}
+	if (src->x >= w || src->y >= h)
+		return 0;
+	src->width = VAL_MIN(src->width, w - src->x);
+	src->height = VAL_MIN(src->height, h - src->y);
+	return src->width > 0 && src->height > 0;
+}
+
+int parse_source(const char *s, struct source *src) {
+	memset(src, 0, sizeof(*src));
+	if (strcmp(s, "cursor") == 0) {
+		src->type = SOURCE_CURSOR;
 		return 1;
-	} else {
+	}
+	if (sscanf(s, "pointer:%d", &src->pointer) == 1) {
+		src->type = SOURCE_POINTER;
+		return 1;
+	}
+	if (sscanf(s, "zone:%d,%d,%dx%d", &src->x, &src->y, &src->width, &src->height) == 4 &&
+			src->width > 0 && src->height > 0) {
+		src->type = SOURCE_ZONE;
+		/* zones given on the command line are clipped once the
+		 * screen is known
+		 */
+		return !screen_geometry.width || clip_zone(src);
+	}
+	return 0;
+}
+
+/* find the source, or start tracking it, and hold a reference to it;
+ * returns its number or -1
+ */
+int add_source(const struct source *src) {
+	int i, slot = -1;
+	if (src->type == SOURCE_CURSOR)
 		return 0;
+	for (i = 1; i < n_sources; i++) {
+		struct source *o = &sources[i];
+		if (o->type == SOURCE_UNUSED && slot < 0)
+			slot = i;
+		if (o->type == src->type && o->pointer == src->pointer && o->x == src->x &&
+				o->y == src->y && o->width == src->width && o->height == src->height) {
+			source_refs[i]++;
+			return i;
+		}
+	}
+	if (slot < 0) {
+		if (n_sources == MAX_SOURCES)
+			return -1;
+		slot = n_sources;
+	}
+	if (src->type == SOURCE_POINTER) {
+		if (n_pointers == MAX_POINTERS)
+			return -1;
+		memset(&pointers[n_pointers], 0, sizeof(pointers[n_pointers]));
+		pointers[n_pointers].deviceid = src->pointer;
+		pointers[n_pointers].source = slot;
+		pointers[n_pointers].old_x = pointers[n_pointers].old_y = -1;
+		n_pointers++;
+	} else {
+		n_zones++;
 	}
+	if (slot == n_sources)
+		n_sources++;
+	sources[slot] = *src;
+	source_refs[slot] = 1;
+	memset(&smoothers[slot], 0, sizeof(smoothers[slot]));
+	return slot;
+}
+
+/* drop a reference taken by add_source(); the source stops being
+ * tracked with the last one, once the main loop gets to reap_sources()
+ * (not while pointers are being sampled), unless it is added again
+ * before
+ */
+void release_source(int i) {
+	if (i <= 0 || i >= n_sources || sources[i].type == SOURCE_UNUSED || source_refs[i] <= 0)
+		return;
+	if (--source_refs[i] == 0)
+		sources_released = 1;
+}
+
+/* stop tracking the sources released, freeing their windows and
+ * captures
+ */
+void reap_sources(Display *d, struct capture *captures) {
+	int i, j;
+	if (!sources_released)
+		return;
+	for (i = 1; i < n_sources; i++) {
+		if (sources[i].type == SOURCE_UNUSED || source_refs[i] > 0)
+			continue;
+		if (sources[i].type == SOURCE_POINTER) {
+			for (j = 1; j < n_pointers; j++) {
+				if (pointers[j].source != i)
+					continue;
+				free(pointers[j].win);
+				pointers[j] = pointers[--n_pointers];
+				break;
+			}
+		} else {
+			n_zones--;
+			free_shm(d, &captures[i]);
+		}
+		sources[i].type = SOURCE_UNUSED;
+		memset(&smoothers[i], 0, sizeof(smoothers[i]));
+	}
+	sources_released = 0;
+}
+
+void usage(const char *name) {
+	printf("Usage: %s [-b | -t MS] [-r RADIUS] [-k KERNEL] [-O] [-x] [-f FILTER] [-q STEP] [-a US] [-F HZ [-D LEVELS [-C]]] [-s NAME] [-S PATH] [-d ID[=SOURCE]]...\n", name);
+	printf("  -b            write all samples to stdout as binary records,\n");
+	printf("                see pixelstream.h\n");
+	printf("  -t MS         print the cursor color at most every MS ms\n");
+	printf("                (default %d, 0 prints every sample)\n", TEXT_INTERVAL);
+	printf("  -r RADIUS     sample the area of RADIUS pixels around pointers\n");
+	printf("                (default %d, at most %d); SIGUSR1 and SIGUSR2 grow\n", RADIUS, MAX_RADIUS);
+	printf("                and shrink it at runtime; without -r the first\n");
+	printf("                subscriber to ask for a radius may set it\n");
+	printf("  -k KERNEL     weight the pixels around pointers: box (default),\n");
+	printf("                gauss, cone, center or dominant (the most common color)\n");
+	printf("  -O            print the OKLab coordinates of the cursor color too\n");
+	printf("  -x            leave the pixels of the cursor sprite out of the areas\n");
+	printf("                around pointers (XFixes); only for servers whose\n");
+	printf("                captures contain the sprite (a software cursor), with\n");
+	printf("                a hardware cursor it drops real pixels instead\n");
+	printf("  -f FILTER     smooth the colors of every source over time: ema:MS\n");
+	printf("                (moving average over MS ms) or euro:HZ,BETA (one-euro\n");
+	printf("                filter, see pixelsmooth.h)\n");
+	printf("  -q STEP       pass on colors only once a channel changed by STEP\n");
+	printf("  -a US         adapt the radius: shrink it while pointers move fast,\n");
+	printf("                grow it back up to RADIUS while they rest, and keep\n");
+	printf("                the CPU time per frame below US microseconds\n");
+	printf("  -F HZ         capture the whole screen HZ times per second and sample\n");
+	printf("                all pointers and zones from that one capture\n");
+	printf("  -D LEVELS     halve the screen LEVELS times on the X server (XRender)\n");
+	printf("                before reading it back\n");
+	printf("  -C            compare the downscaled colors against an exact capture\n");
+	printf("  -s NAME       publish all samples in the shared memory ring NAME\n");
+	printf("                (e.g. /pixeltrack), see pixelring.h\n");
+	printf("  -S PATH       serve samples to subscribers on the Unix domain socket\n");
+	printf("                PATH, see pixelserver.h\n");
+	printf("  -d ID=SOURCE  feed the board with serial number or USB path ID\n");
+	printf("                (e.g. 1-2.3) from SOURCE: cursor (default),\n");
+	printf("                pointer:ID for the master pointer with that XInput\n");
+	printf("                device id or zone:X,Y,WxH for a fixed area of the screen;\n");
+	printf("                only the client pointer and pointers named here or by\n");
+	printf("                subscribers are tracked, other master pointers are ignored\n");
 }
 
 int main(int argc, char *argv[]) {
+	struct capture captures[MAX_SOURCES];
+	struct capture batch;
+	struct capture strip;
+	struct capture screen;
+	int opt, i;
+
+	memset(captures, 0, sizeof(captures));
+	memset(&batch, 0, sizeof(batch));
+	memset(&strip, 0, sizeof(strip));
+	memset(&screen, 0, sizeof(screen));
+	memset(pointers, 0, sizeof(pointers));
+	sources[0].type = SOURCE_CURSOR;
+	pointers[0].old_x = pointers[0].old_y = -1;
+	while ((opt = getopt(argc, argv, "bt:r:k:Oxf:q:a:F:D:Cd:s:S:h")) != -1) {
+		switch (opt) {
+			case 'r':
+				radius = VAL_BETWEEN(0, MAX_RADIUS, atoi(optarg));
+				radius_fixed = 1;
+				break;
+			case 'k':
+				if (!parse_kernel(optarg, &kernel)) {
+					fprintf(stderr, "Invalid kernel: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'O':
+				text_oklab = 1;
+				break;
+			case 'x':
+				exclude_cursor = 1;
+				break;
+			case 'f':
+				if (!parse_smooth(optarg, &smooth)) {
+					fprintf(stderr, "Invalid filter: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'q':
+				smooth.step = VAL_MAX(0, atoi(optarg));
+				break;
+			case 'F':
+				frame_interval = VAL_MAX(1, 1000 / VAL_MAX(1, atoi(optarg)));
+				break;
+			case 'D':
+				downscale = VAL_BETWEEN(0, MAX_LEVELS, atoi(optarg));
+				break;
+			case 'C':
+				check_downscale = 1;
+				break;
+			case 'a':
+				adapt_budget = atol(optarg) * 1000;
+				break;
+			case 'b':
+				binary = 1;
+				break;
+			case 't':
+				text_interval = atoi(optarg);
+				break;
+			case 's':
+				ring = pixel_ring_create(optarg);
+				if (!ring)
+					return 1;
+				break;
+			case 'S':
+				if (!server_open(optarg, add_source, release_source, set_radius))
+					return 1;
+				break;
+#ifdef USB_PIXEL
+			case 'd': {
+				char *src = strchr(optarg, '=');
+				struct source source;
+				int s = 0;
+				if (src) {
+					*src++ = '\0';
+					if (!parse_source(src, &source) || (s = add_source(&source)) < 0) {
+						fprintf(stderr, "Invalid source: %s\n", src);
+						return 1;
+					}
+				}
+				if (!usb_map(optarg, s)) {
+					fprintf(stderr, "Too many boards\n");
+					return 1;
+				}
+				break;
+			}
+#endif
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (binary) {
+		/* records are flushed once per wakeup, not per sample */
+		setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+		if (!pixel_stream_header(stdout))
+			return 1;
+	}
+
 	Display *d = XOpenDisplay(NULL);
 	if (!d) {
-		printf("Unable to open display\n");
-		return;
+		fprintf(stderr, "Unable to open display\n");
+		return 1;
 	}
 #ifdef USB_PIXEL
-	usb_dev_handle *handle = NULL;
-
-	int usb_present = open_usb(&handle);
-	if (!handle) {
-		printf("Unable to open usb device, proceeding anyway...\n");
+	if (!usb_open()) {
+		fprintf(stderr, "Unable to open usb device, proceeding anyway...\n");
 	}
 #endif
-	int radius = RADIUS;
 
-	init_shm(d, radius);
+	/* the cursor source follows the client pointer, further pointers
+	 * are only tracked if a source refers to them
+	 */
+	XIGetClientPointer(d, None, &pointers[0].deviceid);
+
+	if (!init_shm(d, &captures[0], 2*MAX_RADIUS+1, 2*MAX_RADIUS+1) ||
+			!init_shm(d, &batch, 2*(2*MAX_RADIUS+1), 2*(2*MAX_RADIUS+1)) ||
+			/* strips entering sliding windows, see get_strip_color() */
+			!init_shm(d, &strip, 2*MAX_RADIUS+1, 2*MAX_RADIUS+1)) {
+		fprintf(stderr, "Unable to share memory with the X server for captures%s\n",
+				shm_attach_failed ? " (attach failed, is the display remote?)" : "");
+		return 1;
+	}
+	sample_radius = -1;
+	use_radius(&captures[0], &batch, radius);
+	signal(SIGUSR1, radius_signal);
+	signal(SIGUSR2, radius_signal);
 	init_xinput(d);
+	init_geometry(d);
+	for (i = 1; i < n_sources; i++) {
+		if (sources[i].type == SOURCE_ZONE && !clip_zone(&sources[i])) {
+			fprintf(stderr, "Zone %d,%d,%dx%d not within the %dx%d screen\n",
+					sources[i].x, sources[i].y, sources[i].width, sources[i].height,
+					screen_geometry.width, screen_geometry.height);
+			return 1;
+		}
+	}
+	if (exclude_cursor && !init_cursor(d)) {
+		fprintf(stderr, "XFixes not available, sampling the cursor sprite too\n");
+		exclude_cursor = 0;
+	}
 
-	int x = -1;
-	int y = -1;
-	int old_x = -1;
-	int old_y = -1;
-	struct rgb_color color;
-	color.alpha = 255;
-	uint8_t buf[3];
+	if (frame_interval && !init_frame(d, &screen)) {
+		fprintf(stderr, "Unable to capture the whole screen\n");
+		return 1;
+	}
+
+	long next_zones = 0;
+	long next_adapt = 0;
+	long next_frame = 0;
 	while(1) {
-		wait_for_movement(d, &x, &y);
-		if (x != old_x || y != old_y) {
-			refresh_image(d, x, y, radius);
-			get_pixel_color(d, x, y, &color, radius);
-			printf("%d/%d\t(%d/%d/%d)\n", x, y, color.red, color.green, color.blue);
-#ifdef USB_PIXEL
-			if (usb_present) {
-				buf[0] = color.red;
-				buf[1] = color.green;
-				buf[2] = color.blue;
-				int8_t sent = usb_control_msg(handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_OUT, CUSTOM_RQ_SET_RGB, 0, 0, buf, 3, 100);
-				if (sent < 0) {
-					printf("Lost contact to USB device\n");
-					usb_present = 0;
-					handle = NULL;
+		int timeout = -1;
+		if (frame_interval)
+			timeout = VAL_MAX(0, next_frame - now_ms());
+		else if (n_zones)
+			timeout = VAL_MAX(0, next_zones - now_ms());
+		if (text_pending && (timeout < 0 || text_next - now_ms() < timeout))
+			timeout = VAL_MAX(0, text_next - now_ms());
+		if (adapt_budget && sample_radius < radius && (timeout < 0 || next_adapt - now_ms() < timeout))
+			timeout = VAL_MAX(0, next_adapt - now_ms());
+		if (smooth_next && (timeout < 0 || smooth_next - now_ms() < timeout))
+			timeout = VAL_MAX(0, smooth_next - now_ms());
+		int moved = wait_for_movement(d, pointers, n_pointers, timeout);
+		reap_sources(d, captures);
+		if (geometry_changed) {
+			fprintf(stderr, "Screen %dx%d, %d monitors\n",
+					screen_geometry.width, screen_geometry.height, n_monitors);
+			if (frame_interval && !init_frame(d, &screen)) {
+				fprintf(stderr, "Unable to capture the whole screen, sampling pointers only\n");
+				frame_interval = 0;
+			}
+			geometry_changed = 0;
+		}
+		if (radius_request >= 0 || radius_delta)
+			update_radius(&captures[0], &batch);
+		/* in whole screen mode pointers only move with the frame clock */
+		int due = !frame_interval || now_ms() >= next_frame;
+		if (adapt_budget && due) {
+			/* resting pointers are sampled again with a larger radius */
+			if (!moved && sample_radius < radius && now_ms() >= next_adapt) {
+				for (i = 0; i < n_pointers; i++) {
+					pointers[i].moved = pointers[i].old_x >= 0;
+					moved += pointers[i].moved;
 				}
 			}
-#endif
-			old_x = x;
-			old_y = y;
+			if (moved)
+				use_radius(&captures[0], &batch, adapt_radius(pointers, n_pointers));
+		}
+		if (frame_interval && due) {
+			uint64_t cpu = cpu_ns();
+			int n = sample_frame(d, &screen, pointers, n_pointers, sample_radius);
+			adapt_account(cpu_ns() - cpu, n);
+			if (n)
+				next_adapt = now_ms() + ADAPT_INTERVAL;
+			next_frame = now_ms() + frame_interval;
+		} else if (!frame_interval && moved) {
+			uint64_t cpu = cpu_ns();
+			int n = sample_pointers(d, pointers, n_pointers, &captures[0], &batch, &strip, sample_radius);
+			adapt_account(cpu_ns() - cpu, n);
+			next_adapt = now_ms() + ADAPT_INTERVAL;
+		}
+		if (!frame_interval && n_zones && now_ms() >= next_zones) {
+			for (i = 1; i < n_sources; i++) {
+				struct source *src = &sources[i];
+				if (src->type != SOURCE_ZONE)
+					continue;
+				/* zones may be added by subscribers at any time, in
+				 * the place of a released one
+				 */
+				if ((!captures[i].img || captures[i].max_width != src->width ||
+						captures[i].max_height != src->height) &&
+						!init_shm(d, &captures[i], src->width, src->height))
+					continue;
+				if (refresh_area(d, &captures[i], NULL, src->x, src->y))
+					put_zone(d, &captures[i], i);
+			}
+			next_zones = now_ms() + ZONE_INTERVAL;
+		}
+		if (smooth.type && (!smooth_next || now_ms() >= smooth_next)) {
+			if (smooth_next)
+				settle_samples();
+			smooth_next = settling() ? now_ms() + SMOOTH_INTERVAL : 0;
 		}
+		flush_text();
+		fflush(stdout);
 	}
 	XCloseDisplay(d);
 }
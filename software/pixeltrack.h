@@ -0,0 +1,67 @@
+/*
+ * pixeltrack.h
+ *
+ * Types shared by the parts of pixeltrack
+ */
+
+#ifndef __PIXELTRACK_H_INCLUDED__
+#define __PIXELTRACK_H_INCLUDED__
+
+#include <stdint.h>
+
+/* ordered that way due to strange byte order in XImage */
+struct rgb_color {
+	uint8_t blue;
+	uint8_t green;
+	uint8_t red;
+	uint8_t alpha;
+};
+
+/* where the colors for an output are sampled */
+enum source_type {
+	SOURCE_CURSOR,  /* the area around the cursor */
+	SOURCE_ZONE,    /* a fixed rectangle of the screen */
+	SOURCE_POINTER, /* the area around a specific master pointer */
+	SOURCE_UNUSED,  /* released, free to be used again */
+};
+
+/* largest radius of the area sampled around pointers; the radius can
+ * be changed at runtime up to it, the captures are allocated for it once
+ */
+#define MAX_RADIUS 64
+
+/* sources of the colors; source 0 is always the cursor */
+#define MAX_SOURCES 16
+
+struct source {
+	enum source_type type;
+	/* SOURCE_ZONE */
+	int x;
+	int y;
+	int width;
+	int height;
+	/* SOURCE_POINTER: XInput device id */
+	int pointer;
+};
+
+/* parse "cursor", "pointer:ID" or "zone:X,Y,WxH" */
+int parse_source(const char *s, struct source *src);
+
+/* a color sampled from a source, as handed to the outputs */
+struct sample {
+	uint64_t time_ns;   /* CLOCK_MONOTONIC */
+	int source;
+	int x;              /* cursor position, or zone origin */
+	int y;
+	/* the averaged window */
+	int width;
+	int height;
+	int n_pixels;
+	struct rgb_color color;
+};
+
+/* monotonic time in nanoseconds and milliseconds */
+uint64_t now_ns(void);
+long now_ms(void);
+
+#endif /* __PIXELTRACK_H_INCLUDED__ */
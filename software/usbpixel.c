@@ -0,0 +1,346 @@
+/*
+ * usbpixel.c
+ *
+ * Output of colors to any number of PhysPixel boards: boards are found
+ * through libusb hotplug events (or a bus scan where these are not
+ * available), identified by serial number or USB path and reconnected
+ * when they get lost. Every board has its own asynchronous transfer, so
+ * a slow board never holds up the others.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libusb.h>
+
+#include "usbpixel.h"
+#include "../firmware/requests.h"
+
+#define USB_VENDOR_ID  0x16c0
+#define USB_PRODUCT_ID 0x05df
+
+/* after losing a board, try to reopen it that many times; the first
+ * attempt is made after USB_RETRY_DELAY ms, the delay doubles after
+ * every failure
+ */
+#define USB_RETRIES 8
+#define USB_RETRY_DELAY 50
+/* timeout for a single color transfer in ms */
+#define USB_TIMEOUT 100
+
+struct usb_pixel {
+	libusb_device_handle *handle;
+	/* the device last used, kept referenced to reopen it without a bus scan */
+	libusb_device *dev;
+	/* reported by the hotplug callback, opened by usb_poll() */
+	libusb_device *arrived;
+	/* where the board was plugged in and who it was */
+	uint8_t bus;
+	uint8_t ports[7];
+	int n_ports;
+	char path[32];
+	char serial[64];
+	int source;
+	int retries;
+	long next_retry;
+	/* one transfer in flight, the newest color waiting behind it */
+	struct libusb_transfer *transfer;
+	unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE + 3];
+	int busy;
+	int pending;
+	struct rgb_color next;
+	/* the board failed or left, close it once the transfer is done */
+	int failed;
+};
+
+struct usb_mapping {
+	char id[64];
+	int source;
+};
+
+static libusb_context *ctx = NULL;
+static int hotplug = 0;
+static struct usb_pixel pixels[MAX_PIXELS];
+static int n_pixels = 0;
+static struct usb_mapping mappings[MAX_PIXELS];
+static int n_mappings = 0;
+
+int usb_map(const char *id, int source) {
+	if (n_mappings == MAX_PIXELS || strlen(id) >= sizeof(mappings[0].id))
+		return 0;
+	strcpy(mappings[n_mappings].id, id);
+	mappings[n_mappings].source = source;
+	n_mappings++;
+	return 1;
+}
+
+static int is_pixel(libusb_device *dev) {
+	struct libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(dev, &desc) != 0)
+		return 0;
+	return desc.idVendor == USB_VENDOR_ID && desc.idProduct == USB_PRODUCT_ID;
+}
+
+/* is dev plugged in where we saw the board the last time? */
+static int same_port(struct usb_pixel *p, libusb_device *dev) {
+	uint8_t ports[7];
+	int n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	return p->n_ports > 0 && n == p->n_ports &&
+		libusb_get_bus_number(dev) == p->bus &&
+		memcmp(ports, p->ports, n) == 0;
+}
+
+/* find the slot for a device: the one it used before, one that was
+ * lost in the same port, one of a board given up on, or a new one; whether a board in the same
+ * port is the one lost is only known once it is opened
+ */
+static struct usb_pixel *slot_for(libusb_device *dev) {
+	int i;
+	for (i = 0; i < n_pixels; i++) {
+		if (pixels[i].dev == dev)
+			return &pixels[i];
+	}
+	for (i = 0; i < n_pixels; i++) {
+		if (!pixels[i].handle && same_port(&pixels[i], dev))
+			return &pixels[i];
+	}
+	/* the slot of a board given up on is free again */
+	for (i = 0; i < n_pixels; i++) {
+		struct usb_pixel *p = &pixels[i];
+		struct libusb_transfer *t = p->transfer;
+		if (p->handle || p->arrived || p->busy || p->retries < USB_RETRIES)
+			continue;
+		if (p->dev)
+			libusb_unref_device(p->dev);
+		memset(p, 0, sizeof(*p));
+		p->transfer = t;
+		return p;
+	}
+	if (n_pixels == MAX_PIXELS)
+		return NULL;
+	memset(&pixels[n_pixels], 0, sizeof(pixels[n_pixels]));
+	pixels[n_pixels].transfer = libusb_alloc_transfer(0);
+	return &pixels[n_pixels++];
+}
+
+static void map_source(struct usb_pixel *p) {
+	int i;
+	p->source = 0;
+	for (i = 0; i < n_mappings; i++) {
+		if (strcmp(mappings[i].id, p->path) == 0 ||
+				(p->serial[0] && strcmp(mappings[i].id, p->serial) == 0))
+			p->source = mappings[i].source;
+	}
+}
+
+static int open_dev(struct usb_pixel *p, libusb_device *dev) {
+	struct libusb_device_descriptor desc;
+	libusb_device_handle *h;
+	unsigned char serial[sizeof(p->serial)] = "";
+	int i, len;
+
+	if (libusb_open(dev, &h) != 0)
+		return 0;
+	libusb_get_device_descriptor(dev, &desc);
+	if (desc.iSerialNumber)
+		libusb_get_string_descriptor_ascii(h, desc.iSerialNumber, serial, sizeof(serial));
+	/* a different board in the same port takes over the slot, with
+	 * its own serial and mapping
+	 */
+	if (p->serial[0] && p->dev != dev && strcmp((char *)serial, p->serial) != 0)
+		fprintf(stderr, "USB device %s serial %s replaced by serial %s\n",
+				p->path, p->serial, serial[0] ? (char *)serial : "(none)");
+	if (p->dev != dev) {
+		if (p->dev)
+			libusb_unref_device(p->dev);
+		p->dev = libusb_ref_device(dev);
+	}
+	p->handle = h;
+	p->bus = libusb_get_bus_number(dev);
+	p->n_ports = libusb_get_port_numbers(dev, p->ports, sizeof(p->ports));
+	len = snprintf(p->path, sizeof(p->path), "%d", p->bus);
+	for (i = 0; i < p->n_ports && len < (int)sizeof(p->path); i++)
+		len += snprintf(p->path + len, sizeof(p->path) - len, "%c%d", i ? '.' : '-', p->ports[i]);
+	strcpy(p->serial, (char *)serial);
+	p->retries = 0;
+	p->failed = 0;
+	p->busy = 0;
+	p->pending = 0;
+	map_source(p);
+	fprintf(stderr, "USB device %s%s%s connected, source %d\n", p->path,
+			p->serial[0] ? " serial " : "", p->serial, p->source);
+	return 1;
+}
+
+static void close_dev(struct usb_pixel *p) {
+	fprintf(stderr, "Lost contact to USB device %s\n", p->path);
+	libusb_close(p->handle);
+	p->handle = NULL;
+	p->failed = 0;
+	p->retries = 0;
+	p->next_retry = now_ms() + USB_RETRY_DELAY;
+}
+
+static int hotplug_event(libusb_context *c, libusb_device *dev, libusb_hotplug_event event, void *user_data) {
+	struct usb_pixel *p;
+	int i;
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		p = slot_for(dev);
+		if (p && !p->handle && !p->arrived)
+			p->arrived = libusb_ref_device(dev);
+		return 0;
+	}
+	for (i = 0; i < n_pixels; i++) {
+		p = &pixels[i];
+		if (p->handle && p->dev == dev) {
+			/* closing is left to usb_poll(), outside of the callback */
+			p->failed = 1;
+			if (p->busy)
+				libusb_cancel_transfer(p->transfer);
+		}
+	}
+	return 0;
+}
+
+/* full bus scan, only used without hotplug support */
+static void scan(void) {
+	libusb_device **list;
+	ssize_t i, n = libusb_get_device_list(ctx, &list);
+	struct usb_pixel *p;
+
+	for (i = 0; i < n; i++) {
+		if (!is_pixel(list[i]))
+			continue;
+		p = slot_for(list[i]);
+		if (p && !p->handle)
+			open_dev(p, list[i]);
+	}
+	libusb_free_device_list(list, 1);
+}
+
+int usb_open(void) {
+	libusb_hotplug_callback_handle cb;
+	int i, n = 0;
+
+	if (libusb_init(&ctx) != 0)
+		return 0;
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+			libusb_hotplug_register_callback(ctx,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				LIBUSB_HOTPLUG_ENUMERATE, USB_VENDOR_ID, USB_PRODUCT_ID,
+				LIBUSB_HOTPLUG_MATCH_ANY, hotplug_event, NULL, &cb) == 0) {
+		/* present boards have been reported to the callback already */
+		hotplug = 1;
+		usb_poll();
+	} else {
+		scan();
+	}
+	for (i = 0; i < n_pixels; i++)
+		n += pixels[i].handle != NULL;
+	return n;
+}
+
+void usb_poll(void) {
+	struct timeval zero = {0, 0};
+	struct usb_pixel *p;
+	int i, rescan = 0;
+
+	if (!ctx)
+		return;
+	libusb_handle_events_timeout_completed(ctx, &zero, NULL);
+	for (i = 0; i < n_pixels; i++) {
+		p = &pixels[i];
+		if (p->handle) {
+			if (p->failed && !p->busy)
+				close_dev(p);
+			continue;
+		}
+		if (p->arrived) {
+			open_dev(p, p->arrived);
+			libusb_unref_device(p->arrived);
+			p->arrived = NULL;
+			continue;
+		}
+		if (p->retries >= USB_RETRIES || now_ms() < p->next_retry)
+			continue;
+		if (p->dev && open_dev(p, p->dev))
+			continue;
+		rescan = !hotplug;
+		p->next_retry = now_ms() + (USB_RETRY_DELAY << p->retries);
+		if (++p->retries == USB_RETRIES)
+			fprintf(stderr, "Giving up on USB device %s%s\n", p->path,
+					hotplug ? " until it is plugged in again" : "");
+	}
+	if (rescan)
+		scan();
+}
+
+int usb_pollfds(struct pollfd *fds, int max) {
+	const struct libusb_pollfd **list;
+	int n = 0;
+
+	if (!ctx || !(list = libusb_get_pollfds(ctx)))
+		return 0;
+	for (; list[n] && n < max; n++) {
+		fds[n].fd = list[n]->fd;
+		fds[n].events = list[n]->events;
+	}
+	libusb_free_pollfds(list);
+	return n;
+}
+
+int usb_timeout(void) {
+	long next = -1, now = now_ms();
+	int i;
+	for (i = 0; i < n_pixels; i++) {
+		struct usb_pixel *p = &pixels[i];
+		if (p->handle || p->retries >= USB_RETRIES)
+			continue;
+		if (next < 0 || p->next_retry < next)
+			next = p->next_retry;
+	}
+	if (next < 0)
+		return -1;
+	return next > now ? next - now : 0;
+}
+
+static void submit(struct usb_pixel *p, const struct rgb_color *c);
+
+static void transfer_done(struct libusb_transfer *t) {
+	struct usb_pixel *p = t->user_data;
+	p->busy = 0;
+	if (t->status != LIBUSB_TRANSFER_COMPLETED)
+		p->failed = 1;
+	if (p->pending && !p->failed) {
+		p->pending = 0;
+		submit(p, &p->next);
+	}
+}
+
+static void submit(struct usb_pixel *p, const struct rgb_color *c) {
+	libusb_fill_control_setup(p->buf, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
+			CUSTOM_RQ_SET_RGB, 0, 0, 3);
+	p->buf[LIBUSB_CONTROL_SETUP_SIZE] = c->red;
+	p->buf[LIBUSB_CONTROL_SETUP_SIZE+1] = c->green;
+	p->buf[LIBUSB_CONTROL_SETUP_SIZE+2] = c->blue;
+	libusb_fill_control_transfer(p->transfer, p->handle, p->buf, transfer_done, p, USB_TIMEOUT);
+	if (libusb_submit_transfer(p->transfer) == 0)
+		p->busy = 1;
+	else
+		p->failed = 1;
+}
+
+void usb_send(int source, const struct rgb_color *c) {
+	int i;
+	for (i = 0; i < n_pixels; i++) {
+		struct usb_pixel *p = &pixels[i];
+		if (!p->handle || p->failed || p->source != source)
+			continue;
+		if (p->busy) {
+			p->next = *c;
+			p->pending = 1;
+		} else {
+			submit(p, c);
+		}
+	}
+}
@@ -0,0 +1,38 @@
+/*
+ * usbpixel.h
+ *
+ * Output of colors to any number of PhysPixel boards
+ */
+
+#ifndef __USBPIXEL_H_INCLUDED__
+#define __USBPIXEL_H_INCLUDED__
+
+#include <poll.h>
+#include "pixeltrack.h"
+
+/* boards handled at the same time */
+#define MAX_PIXELS 16
+
+/* feed the board with the given serial number or USB path (e.g. "1-2.3")
+ * from a source; boards not mapped are fed from source 0
+ */
+int usb_map(const char *id, int source);
+
+/* open all boards present, returns the number of boards found */
+int usb_open(void);
+
+/* handle USB events and reconnect lost boards; never blocks */
+void usb_poll(void);
+
+/* file descriptors and timeout (in ms, -1 for none) to wait for before
+ * calling usb_poll() again
+ */
+int usb_pollfds(struct pollfd *fds, int max);
+int usb_timeout(void);
+
+/* queue a color for all boards fed from the source; a board still busy
+ * with the previous color only keeps the newest one
+ */
+void usb_send(int source, const struct rgb_color *c);
+
+#endif /* __USBPIXEL_H_INCLUDED__ */
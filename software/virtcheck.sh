@@ -0,0 +1,49 @@
+#!/bin/sh
+# Attaches virtpixel through USB/IP, sends a few colors with pixelsend
+# and checks that virtpixel logged exactly these. Needs root, the usbip
+# tool and the vhci-hcd module.
+#
+# Usage: virtcheck.sh [port]
+
+PORT=${1:-3240}
+COLORS="255/0/0 0/255/0 0/0/255 12/34/56 0/0/0"
+LOG=$(mktemp)
+
+./virtpixel -p $PORT > $LOG &
+PID=$!
+trap 'kill $PID 2>/dev/null; rm -f $LOG' EXIT
+sleep 1
+
+modprobe vhci-hcd 2>/dev/null
+if ! usbip --tcp-port $PORT attach -r 127.0.0.1 -b 1-1; then
+	echo "FAIL: unable to attach virtpixel"
+	exit 1
+fi
+# wait for the device to be enumerated
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	./pixelsend 0/0/0 2>/dev/null && break
+	sleep 1
+done
+./pixelsend $COLORS
+SENT=$?
+usbip port | awk -v r="127.0.0.1:$PORT/1-1" '
+	/^Port/ { p = $2 + 0 }
+	index($0, r) { print p }' | while read p; do
+	usbip detach -p $p
+done
+sleep 1
+
+if [ $SENT -ne 0 ]; then
+	echo "FAIL: unable to send colors"
+	exit 1
+fi
+# the log starts with the probes sent while waiting for the device
+GOT=$(cut -f2 $LOG | tr '\n' ' ')
+case "$GOT" in
+	*" $COLORS ") ;;
+	*)
+		echo "FAIL: sent $COLORS, virtpixel logged $GOT"
+		exit 1
+		;;
+esac
+echo "virtpixel logged all colors"
@@ -0,0 +1,488 @@
+/*
+ * virtpixel.c
+ *
+ * A virtual PhysPixel: runs the firmware logic on the host and exports
+ * it as a USB device through USB/IP, so pixeltrack can be exercised
+ * without the hardware:
+ *
+ *   ./virtpixel &
+ *   usbip attach -r localhost -b 1-1
+ *
+ * Every color received is printed with a timestamp (seconds since the
+ * epoch), attach and detach events are reported on stderr.
+ *
+ * Only local connections are accepted unless another address to listen
+ * on is given with -l (e.g. -l 0.0.0.0 to export to other hosts).
+ * virtcheck.sh attaches the device and checks the colors logged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/* the firmware logic and its host mocks, see ../firmware/host */
+#include "usbdrv.h"
+#include "requests.h"
+#include "usbconfig.h"
+
+#define USBIP_PORT 3240
+#define USBIP_VERSION 0x0111
+#define BUSID "1-1"
+
+#define OP_REQ_DEVLIST 0x8005
+#define OP_REP_DEVLIST 0x0005
+#define OP_REQ_IMPORT  0x8003
+#define OP_REP_IMPORT  0x0003
+
+#define USBIP_CMD_SUBMIT 1
+#define USBIP_CMD_UNLINK 2
+#define USBIP_RET_SUBMIT 3
+#define USBIP_RET_UNLINK 4
+
+#define USBIP_DIR_OUT 0
+#define USBIP_DIR_IN  1
+
+#define USB_SPEED_LOW 1
+
+/* all USB/IP fields are big endian */
+struct op_header {
+	uint16_t version;
+	uint16_t code;
+	uint32_t status;
+} __attribute__((packed));
+
+struct op_device {
+	char path[256];
+	char busid[32];
+	uint32_t busnum;
+	uint32_t devnum;
+	uint32_t speed;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	uint8_t bDeviceClass;
+	uint8_t bDeviceSubClass;
+	uint8_t bDeviceProtocol;
+	uint8_t bConfigurationValue;
+	uint8_t bNumConfigurations;
+	uint8_t bNumInterfaces;
+} __attribute__((packed));
+
+struct op_interface {
+	uint8_t bInterfaceClass;
+	uint8_t bInterfaceSubClass;
+	uint8_t bInterfaceProtocol;
+	uint8_t padding;
+} __attribute__((packed));
+
+struct urb_header {
+	uint32_t command;
+	uint32_t seqnum;
+	uint32_t devid;
+	uint32_t direction;
+	uint32_t ep;
+	union {
+		struct {
+			uint32_t transfer_flags;
+			int32_t length;
+			int32_t start_frame;
+			int32_t number_of_packets;
+			int32_t interval;
+			uint8_t setup[8];
+		} submit;
+		struct {
+			int32_t status;
+			int32_t length;
+			int32_t start_frame;
+			int32_t number_of_packets;
+			int32_t error_count;
+			uint8_t padding[8];
+		} ret;
+		struct {
+			uint32_t seqnum;
+			uint8_t padding[24];
+		} unlink;
+	} u;
+} __attribute__((packed));
+
+/* descriptors as generated by usbdrv.c from the same usbconfig.h */
+static const uint8_t device_descriptor[18] = {
+	18, 1,                  /* length, type: device */
+	0x10, 0x01,             /* USB 1.1 */
+	USB_CFG_DEVICE_CLASS,
+	USB_CFG_DEVICE_SUBCLASS,
+	0,                      /* protocol */
+	8,                      /* max packet size */
+	USB_CFG_VENDOR_ID,
+	USB_CFG_DEVICE_ID,
+	USB_CFG_DEVICE_VERSION,
+	1, 2, 0,                /* manufacturer, product, serial string */
+	1,                      /* number of configurations */
+};
+
+static const uint8_t config_descriptor[] = {
+	9, 2,                   /* length, type: configuration */
+	18 + 7 * USB_CFG_HAVE_INTRIN_ENDPOINT + 9, 0,
+	1,                      /* number of interfaces */
+	1,                      /* index of this configuration */
+	0,                      /* configuration name string */
+	1 << 7,                 /* attributes: bus powered */
+	USB_CFG_MAX_BUS_POWER/2,
+	/* interface */
+	9, 4, 0, 0,
+	USB_CFG_HAVE_INTRIN_ENDPOINT,
+	USB_CFG_INTERFACE_CLASS,
+	USB_CFG_INTERFACE_SUBCLASS,
+	USB_CFG_INTERFACE_PROTOCOL,
+	0,
+	/* HID */
+	9, 0x21, 0x01, 0x01, 0x00, 0x01, 0x22,
+	USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH, 0,
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+	/* interrupt IN endpoint 1 */
+	7, 5, 0x81, 0x03, 8, 0,
+	USB_CFG_INTR_POLL_INTERVAL,
+#endif
+};
+
+static const char vendor_name[] = { USB_CFG_VENDOR_NAME };
+static const char device_name[] = { USB_CFG_DEVICE_NAME };
+
+static int quiet = 0;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+	uint8_t *p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void fill_device(struct op_device *dev) {
+	memset(dev, 0, sizeof(*dev));
+	strcpy(dev->path, "/sys/devices/virtual/physpixel");
+	strcpy(dev->busid, BUSID);
+	dev->busnum = htonl(1);
+	dev->devnum = htonl(1);
+	dev->speed = htonl(USB_SPEED_LOW);
+	dev->idVendor = htons(device_descriptor[8] | device_descriptor[9]<<8);
+	dev->idProduct = htons(device_descriptor[10] | device_descriptor[11]<<8);
+	dev->bcdDevice = htons(device_descriptor[12] | device_descriptor[13]<<8);
+	dev->bDeviceClass = USB_CFG_DEVICE_CLASS;
+	dev->bDeviceSubClass = USB_CFG_DEVICE_SUBCLASS;
+	dev->bConfigurationValue = 1;
+	dev->bNumConfigurations = 1;
+	dev->bNumInterfaces = 1;
+}
+
+static int string_descriptor(const char *s, int len, uint8_t *buf) {
+	int i;
+	buf[0] = 2 + 2*len;
+	buf[1] = 3;
+	for (i = 0; i < len; i++) {
+		buf[2+2*i] = s[i];
+		buf[3+2*i] = 0;
+	}
+	return buf[0];
+}
+
+/* Handle a standard request; returns the reply length or -1 to stall. */
+static int standard_request(const usbRequest_t *rq, uint8_t *buf) {
+	int len = -1;
+
+	switch (rq->bRequest) {
+		case 0x00:  /* GET_STATUS */
+			buf[0] = buf[1] = 0;
+			return 2;
+		case 0x08:  /* GET_CONFIGURATION */
+			buf[0] = 1;
+			return 1;
+		case 0x06:  /* GET_DESCRIPTOR */
+			switch (rq->wValue.bytes[1]) {
+				case 1:
+					len = sizeof(device_descriptor);
+					memcpy(buf, device_descriptor, len);
+					break;
+				case 2:
+					len = sizeof(config_descriptor);
+					memcpy(buf, config_descriptor, len);
+					break;
+				case 3:
+					if (rq->wValue.bytes[0] == 0) {
+						/* supported languages: US English */
+						buf[0] = 4; buf[1] = 3; buf[2] = 0x09; buf[3] = 0x04;
+						len = 4;
+					} else if (rq->wValue.bytes[0] == 1) {
+						len = string_descriptor(vendor_name, sizeof(vendor_name), buf);
+					} else if (rq->wValue.bytes[0] == 2) {
+						len = string_descriptor(device_name, sizeof(device_name), buf);
+					}
+					break;
+				case 0x22:
+					len = USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH;
+					memcpy(buf, usbHidReportDescriptor, len);
+					break;
+			}
+			return len;
+		default:
+			/* SET_CONFIGURATION, SET_INTERFACE, CLEAR_FEATURE... */
+			return 0;
+	}
+}
+
+static void log_color(const usbRequest_t *rq, const uint8_t *data) {
+	if (quiet)
+		return;
+	if (rq->bRequest == CUSTOM_RQ_SET_RGB)
+		printf("%.6f\t%d/%d/%d\n", now(), data[0], data[1], data[2]);
+	else if (rq->bRequest == CUSTOM_RQ_SET_RGB16)
+		printf("%.6f\t%d/%d/%d\n", now(),
+				data[0] | data[1]<<8, data[2] | data[3]<<8, data[4] | data[5]<<8);
+	fflush(stdout);
+}
+
+/* Run a control transfer on endpoint 0, like V-USB would: standard
+ * requests are answered here, everything else goes to usbFunctionSetup().
+ */
+static int control_transfer(const uint8_t setup[8], uint8_t *buf, int len) {
+	usbRequest_t rq;
+	int n;
+
+	rq.bmRequestType = setup[0];
+	rq.bRequest = setup[1];
+	rq.wValue.word = setup[2] | setup[3]<<8;
+	rq.wIndex.word = setup[4] | setup[5]<<8;
+	rq.wLength.word = setup[6] | setup[7]<<8;
+
+	if ((rq.bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_STANDARD) {
+		uint8_t reply[256];
+		n = standard_request(&rq, reply);
+		if (n > len)
+			n = len;
+		if (n > 0)
+			memcpy(buf, reply, n);
+		return n;
+	}
+	n = usbMockControl(rq.bmRequestType, rq.bRequest, rq.wValue.word, rq.wIndex.word, buf, len);
+	if (n > 0 && (rq.bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_VENDOR)
+		log_color(&rq, buf);
+	return n;
+}
+
+/* interrupt IN transfers are never answered, but may be unlinked */
+#define MAX_PENDING 16
+static uint32_t pending[MAX_PENDING];
+static int n_pending;
+
+static int take_pending(uint32_t seqnum) {
+	int i;
+	for (i = 0; i < n_pending; i++) {
+		if (pending[i] == seqnum) {
+			pending[i] = pending[--n_pending];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int serve_urbs(int fd) {
+	struct urb_header h, r;
+	uint8_t buf[4096];
+
+	n_pending = 0;
+	while (read_full(fd, &h, sizeof(h)) == 0) {
+		memset(&r, 0, sizeof(r));
+		r.seqnum = h.seqnum;
+
+		if (ntohl(h.command) == USBIP_CMD_UNLINK) {
+			r.command = htonl(USBIP_RET_UNLINK);
+			r.u.ret.status = htonl(take_pending(ntohl(h.u.unlink.seqnum)) ? -ECONNRESET : 0);
+			if (write_full(fd, &r, sizeof(r)))
+				return -1;
+			continue;
+		}
+		if (ntohl(h.command) != USBIP_CMD_SUBMIT) {
+			fprintf(stderr, "Unknown USB/IP command %u\n", ntohl(h.command));
+			return -1;
+		}
+
+		int32_t len = ntohl(h.u.submit.length);
+		int in = ntohl(h.direction) == USBIP_DIR_IN;
+		if (len < 0 || len > (int32_t)sizeof(buf))
+			return -1;
+		if (!in && len > 0 && read_full(fd, buf, len))
+			return -1;
+
+		if (ntohl(h.ep) != 0) {
+			if (n_pending < MAX_PENDING) {
+				pending[n_pending++] = ntohl(h.seqnum);
+				continue;
+			}
+			len = -EPIPE;
+		} else {
+			len = control_transfer(h.u.submit.setup, buf, len);
+			if (len < 0)
+				len = -EPIPE;
+		}
+
+		r.command = htonl(USBIP_RET_SUBMIT);
+		if (len < 0) {
+			r.u.ret.status = htonl(len);
+			len = 0;
+		}
+		r.u.ret.length = htonl(len);
+		if (write_full(fd, &r, sizeof(r)))
+			return -1;
+		if (in && len > 0 && write_full(fd, buf, len))
+			return -1;
+	}
+	return 0;
+}
+
+/* Answer the management request of a new connection; returns 1 if the
+ * device was imported and URBs follow.
+ */
+static int serve_op(int fd) {
+	struct op_header h, r;
+	struct op_device dev;
+	struct op_interface intf = {
+		USB_CFG_INTERFACE_CLASS, USB_CFG_INTERFACE_SUBCLASS, USB_CFG_INTERFACE_PROTOCOL, 0
+	};
+	char busid[32];
+	uint32_t n = htonl(1);
+
+	if (read_full(fd, &h, sizeof(h)))
+		return 0;
+	r.version = htons(USBIP_VERSION);
+	r.status = 0;
+	fill_device(&dev);
+
+	switch (ntohs(h.code)) {
+		case OP_REQ_DEVLIST:
+			r.code = htons(OP_REP_DEVLIST);
+			write_full(fd, &r, sizeof(r));
+			write_full(fd, &n, sizeof(n));
+			write_full(fd, &dev, sizeof(dev));
+			write_full(fd, &intf, sizeof(intf));
+			return 0;
+		case OP_REQ_IMPORT:
+			if (read_full(fd, busid, sizeof(busid)))
+				return 0;
+			r.code = htons(OP_REP_IMPORT);
+			if (strncmp(busid, BUSID, sizeof(busid)) != 0) {
+				r.status = htonl(1);
+				write_full(fd, &r, sizeof(r));
+				return 0;
+			}
+			write_full(fd, &r, sizeof(r));
+			write_full(fd, &dev, sizeof(dev));
+			return 1;
+		default:
+			fprintf(stderr, "Unknown USB/IP operation 0x%04x\n", ntohs(h.code));
+			return 0;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int port = USBIP_PORT;
+	int opt, one = 1;
+	struct sockaddr_in addr;
+	struct in_addr listen_addr = { htonl(INADDR_LOOPBACK) };
+
+	while ((opt = getopt(argc, argv, "l:p:q")) != -1) {
+		switch (opt) {
+			case 'l':
+				if (!inet_aton(optarg, &listen_addr)) {
+					fprintf(stderr, "Invalid address to listen on: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'q':
+				quiet = 1;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-l address] [-p port] [-q]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s < 0) {
+		perror("Unable to create a socket");
+		return 1;
+	}
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr = listen_addr;
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) || listen(s, 1)) {
+		perror("Unable to listen for USB/IP connections");
+		return 1;
+	}
+	fprintf(stderr, "Exporting PhysPixel as %s on %s port %d\n", BUSID, inet_ntoa(listen_addr), port);
+
+	while (1) {
+		int c = accept(s, NULL, NULL);
+		if (c < 0) {
+			/* connections that were given up before being accepted */
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			int err = errno;
+			perror("Unable to accept a USB/IP connection");
+			/* out of descriptors or memory, try again later; any
+			 * other error will not go away
+			 */
+			if (err != EMFILE && err != ENFILE && err != ENOBUFS && err != ENOMEM)
+				return 1;
+			sleep(1);
+			continue;
+		}
+		setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (serve_op(c)) {
+			fprintf(stderr, "%.6f\tattached\n", now());
+			serve_urbs(c);
+			fprintf(stderr, "%.6f\tdetached\n", now());
+		}
+		close(c);
+	}
+}